@@ -0,0 +1,39 @@
+open Lib
+
+(*
+ * Throughput of name validation over corpora shaped like the names of bulk
+ * create, snapshot and rename jobs.  Run with an optional corpus size, e.g.
+ *   dune exec bench/bench_names.exe -- 1000000
+ *)
+
+let count =
+  if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1) else 1_000_000
+
+let time label names f =
+  let start = Unix.gettimeofday () in
+  ignore (Sys.opaque_identity (f names));
+  let seconds = Unix.gettimeofday () -. start in
+  Printf.printf "%-28s %12.0f names/s\n" label
+    (float_of_int (Array.length names) /. seconds)
+
+let filesystems =
+  Array.init count (fun i ->
+      Printf.sprintf "tank/customers/c%05d/home/user-%d" (i mod 40000) i)
+
+let snapshots =
+  Array.init count (fun i ->
+      Printf.sprintf "tank/vm/disk-%04d@autosnap_2024-%02d-%02d_00:00:00_daily"
+        (i mod 5000) (1 + (i mod 12)) (1 + (i mod 28)))
+
+let pools = Array.init count (fun i -> Printf.sprintf "pool-%d.ssd" i)
+
+let () =
+  let fs = [| Zfs_prop.Filesystem |] and snap = [| Zfs_prop.Snapshot |] in
+  time "filesystems" filesystems (fun names ->
+      Array.map (fun name -> Zfs_prop.validate_name name fs true) names);
+  time "filesystems, batched" filesystems (fun names ->
+      Zfs_prop.validate_names names fs true);
+  time "snapshots, batched" snapshots (fun names ->
+      Zfs_prop.validate_names names snap true);
+  time "pools, batched" pools (fun names ->
+      Zpool_prop.validate_names names false)
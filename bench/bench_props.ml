@@ -0,0 +1,52 @@
+open Nvpair
+open Lib
+
+(*
+ * Throughput of property validation and of the attribute lookups it is built
+ * on.  Run with an optional iteration count, e.g.
+ *   dune exec bench/bench_props.exe -- 200000
+ *)
+
+let iterations =
+  if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1) else 100_000
+
+let time label n f =
+  let start = Unix.gettimeofday () in
+  for _ = 1 to n do
+    f ()
+  done;
+  let seconds = Unix.gettimeofday () -. start in
+  Printf.printf "%-26s %12.0f/s\n" label (float_of_int n /. seconds)
+
+let props () =
+  let nvl = Nvlist.alloc () in
+  Nvlist.add_string nvl "compression" "lz4";
+  Nvlist.add_string nvl "atime" "off";
+  Nvlist.add_string nvl "recordsize" "1M";
+  Nvlist.add_string nvl "quota" "10G";
+  Nvlist.add_string nvl "mountpoint" "/srv/data";
+  Nvlist.add_string nvl "xattr" "sa";
+  Nvlist.add_string nvl "org.example:owner" "ops";
+  nvl
+
+let () =
+  let nvl = props () in
+  time "Zfs_prop.validate" iterations (fun () ->
+      match Zfs_prop.validate nvl Zfs_prop.Filesystem false true false with
+      | Ok _ -> ()
+      | Error (_, why) -> failwith why);
+  let plan = Zfs_prop.compile Zfs_prop.Filesystem false true false in
+  time "Zfs_prop.validate_planned" iterations (fun () ->
+      match Zfs_prop.validate_planned plan nvl with
+      | Ok _ -> ()
+      | Error (_, why) -> failwith why);
+  time "Zfs_prop.attributes" (iterations * 100) (fun () ->
+      ignore (Sys.opaque_identity (Zfs_prop.attributes Zfs_prop.Compression)));
+  time "Zfs_prop.string_to_index" (iterations * 100) (fun () ->
+      ignore
+        (Sys.opaque_identity
+           (Zfs_prop.string_to_index Zfs_prop.Compression "zstd")));
+  time "Zpool_prop.to_string" (iterations * 100) (fun () ->
+      ignore (Sys.opaque_identity (Zpool_prop.to_string Zpool_prop.Ashift)));
+  time "Vdev_prop.to_string" (iterations * 100) (fun () ->
+      ignore (Sys.opaque_identity (Vdev_prop.to_string Vdev_prop.Guid)))
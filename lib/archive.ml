@@ -0,0 +1,327 @@
+open Error
+open Nvpair
+
+(*
+ * A send stream stored as a directory of chunk files plus an index.  Chunks
+ * end on record boundaries, so each one can be uploaded, verified or
+ * inspected on its own, and concatenating them in order gives back the
+ * original stream.  The index is a packed nvlist:
+ *
+ *   version      uint64
+ *   chunk_size   uint64  target chunk size
+ *   toguid       uint64  of the BEGIN record
+ *   fromguid     uint64  of the BEGIN record, 0 for a full stream
+ *   chunks       nvlist array, one per chunk in stream order:
+ *     offset     uint64  of the chunk in the stream
+ *     length     uint64
+ *     sha256     string  hex digest of the chunk
+ *     records    uint64 array  record offsets relative to the chunk
+ *     first_object, last_object  uint64  range of objects touched, if any
+ *)
+
+let version = 1L
+let index_name = "index"
+let chunk_name i = Printf.sprintf "chunk.%08d" i
+
+type chunk = {
+  offset : int;
+  length : int;
+  sha256 : string;
+  records : int array;
+  objects : (int64 * int64) option;
+}
+
+type index = {
+  chunk_size : int;
+  toguid : int64;
+  fromguid : int64;
+  chunks : chunk array;
+}
+
+let write_file path buf len =
+  let fd =
+    Unix.openfile path [ Unix.O_WRONLY; Unix.O_CREAT; Unix.O_TRUNC ] 0o644
+  in
+  Fun.protect
+    ~finally:(fun () -> Unix.close fd)
+    (fun () -> Send_stream.really_write fd buf 0 len)
+
+let read_file path =
+  let fd = Unix.openfile path [ Unix.O_RDONLY ] 0 in
+  Fun.protect
+    ~finally:(fun () -> Unix.close fd)
+    (fun () ->
+      let len = (Unix.fstat fd).Unix.st_size in
+      let buf = Bytes.create len in
+      let n = Send_stream.really_read fd buf 0 len in
+      if n < len then Bytes.sub buf 0 n else buf)
+
+let pack_index index =
+  let nvl = Nvlist.alloc () in
+  Nvlist.add_uint64 nvl "version" version;
+  Nvlist.add_uint64 nvl "chunk_size" (Int64.of_int index.chunk_size);
+  Nvlist.add_uint64 nvl "toguid" index.toguid;
+  Nvlist.add_uint64 nvl "fromguid" index.fromguid;
+  let chunks =
+    Array.map
+      (fun chunk ->
+        let c = Nvlist.alloc () in
+        Nvlist.add_uint64 c "offset" (Int64.of_int chunk.offset);
+        Nvlist.add_uint64 c "length" (Int64.of_int chunk.length);
+        Nvlist.add_string c "sha256" chunk.sha256;
+        Nvlist.add_uint64_array c "records"
+        @@ Array.map Int64.of_int chunk.records;
+        Option.iter
+          (fun (first, last) ->
+            Nvlist.add_uint64 c "first_object" first;
+            Nvlist.add_uint64 c "last_object" last)
+          chunk.objects;
+        c)
+      index.chunks
+  in
+  Nvlist.add_nvlist_array nvl "chunks" chunks;
+  Nvlist.(pack nvl Native)
+
+let unpack_index packed =
+  let corrupt = Error (EzfsBadStream, "archive index is corrupt") in
+  match Nvlist.unpack packed with
+  | exception _ -> corrupt
+  | nvl -> (
+      let chunk c =
+        match
+          ( Nvlist.lookup_uint64 c "offset",
+            Nvlist.lookup_uint64 c "length",
+            Nvlist.lookup_string c "sha256",
+            Nvlist.lookup_uint64_array c "records" )
+        with
+        | Some offset, Some length, Some sha256, Some records ->
+            let objects =
+              match
+                ( Nvlist.lookup_uint64 c "first_object",
+                  Nvlist.lookup_uint64 c "last_object" )
+              with
+              | Some first, Some last -> Some (first, last)
+              | _ -> None
+            in
+            Some
+              {
+                offset = Int64.to_int offset;
+                length = Int64.to_int length;
+                sha256;
+                records = Array.map Int64.to_int records;
+                objects;
+              }
+        | _ -> None
+      in
+      match
+        ( Nvlist.lookup_uint64 nvl "version",
+          Nvlist.lookup_uint64 nvl "chunk_size",
+          Nvlist.lookup_uint64 nvl "toguid",
+          Nvlist.lookup_uint64 nvl "fromguid",
+          Nvlist.lookup_nvlist_array nvl "chunks" )
+      with
+      | Some v, _, _, _, _ when not (Int64.equal v version) ->
+          Error
+            (EzfsBadStream, Printf.sprintf "unsupported archive version %Lu" v)
+      | Some _, Some chunk_size, Some toguid, Some fromguid, Some chunks ->
+          let chunks = Array.map chunk chunks in
+          if Array.exists Option.is_none chunks then corrupt
+          else
+            Ok
+              {
+                chunk_size = Int64.to_int chunk_size;
+                toguid;
+                fromguid;
+                chunks = Array.map Option.get chunks;
+              }
+      | _ -> corrupt)
+
+let read_index dir =
+  match
+    unix_error (fun () ->
+        unpack_index @@ read_file (Filename.concat dir index_name))
+  with
+  | Ok index -> Ok index
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot read archive '%s'" dir in
+      Error (e, what, why)
+
+(*
+ * Split the stream read from fd into chunks of about chunk_size bytes in
+ * dir, which must exist.  A record larger than chunk_size gets a chunk of
+ * its own.
+ *)
+let write dir chunk_size fd =
+  let ( let* ) = Result.bind in
+  match
+    unix_error @@ fun () ->
+    let r = Send_stream.reader fd in
+    let buf = Buffer.create chunk_size in
+    let records = ref [] in
+    let objects = ref None in
+    let chunks = ref [] in
+    let flush () =
+      if Buffer.length buf > 0 then (
+        let data = Buffer.to_bytes buf in
+        let len = Bytes.length data in
+        let i = List.length !chunks in
+        write_file (Filename.concat dir (chunk_name i)) data len;
+        let offset =
+          match !chunks with c :: _ -> c.offset + c.length | [] -> 0
+        in
+        let sha256 = Util.hex_of_string @@ Util.sha256 data 0 len in
+        let offsets = Array.of_list @@ List.rev !records in
+        let chunk =
+          {
+            offset;
+            length = len;
+            sha256;
+            records = offsets;
+            objects = !objects;
+          }
+        in
+        chunks := chunk :: !chunks;
+        Buffer.clear buf;
+        records := [];
+        objects := None)
+    in
+    let rec loop guids =
+      let* next = Send_stream.next r in
+      match next with
+      | Some record ->
+          let length = Send_stream.record_length record in
+          if Buffer.length buf > 0 && Buffer.length buf + length > chunk_size
+          then flush ();
+          records := Buffer.length buf :: !records;
+          Buffer.add_bytes buf record.Send_stream.header;
+          Buffer.add_bytes buf record.payload;
+          (match Send_stream.record_object r record with
+          | Some obj ->
+              objects :=
+                Some
+                  (match !objects with
+                  | Some (first, last) ->
+                      ( (if Int64.unsigned_compare obj first < 0 then obj
+                         else first),
+                        if Int64.unsigned_compare obj last > 0 then obj
+                        else last )
+                  | None -> (obj, obj))
+          | None -> ());
+          let guids =
+            match (guids, record.rtype) with
+            | None, Send_stream.DrrBegin ->
+                Some (Send_stream.begin_guids r record)
+            | _ -> guids
+          in
+          loop guids
+      | None -> (
+          flush ();
+          match guids with
+          | Some (toguid, fromguid) ->
+              let chunks = Array.of_list @@ List.rev !chunks in
+              let index = { chunk_size; toguid; fromguid; chunks } in
+              let packed = pack_index index in
+              write_file
+                (Filename.concat dir index_name)
+                packed (Bytes.length packed);
+              Ok index
+          | None -> Error (EzfsBadStream, "stream is empty"))
+    in
+    loop None
+  with
+  | Ok index -> Ok index
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot write archive '%s'" dir in
+      Error (e, what, why)
+
+(* Send tosnap into a new archive in dir. *)
+let send handle tosnap fromopt flags dir chunk_size =
+  let send_r, send_w = Unix.pipe ~cloexec:true () in
+  let sender =
+    Domain.spawn (fun () ->
+        let result = Zfs.send handle tosnap fromopt send_w flags in
+        Unix.close send_w;
+        result)
+  in
+  let written = write dir chunk_size send_r in
+  Unix.close send_r;
+  match (Domain.join sender, written) with
+  | Ok (), Ok index -> Ok index
+  (* A failed write shows up on the sending side as a broken pipe. *)
+  | Error (EzfsIo, _, _), Error e -> Error e
+  | Error e, _ -> Error e
+  | Ok (), Error e -> Error e
+
+let chunk_matches chunk data =
+  Bytes.length data = chunk.length
+  && String.equal chunk.sha256
+       (Util.hex_of_string @@ Util.sha256 data 0 chunk.length)
+
+let verify_chunk dir i chunk =
+  match read_file (Filename.concat dir (chunk_name i)) with
+  | data -> chunk_matches chunk data
+  | exception Unix.Unix_error (_, _, _) -> false
+
+(* The indices of the chunks that are missing or do not match the index. *)
+let verify jobs dir index =
+  Parallel.map_local jobs
+    (fun (i, chunk) -> if verify_chunk dir i chunk then None else Some i)
+    (Array.mapi (fun i chunk -> (i, chunk)) index.chunks)
+  |> Array.to_list |> List.filter_map Fun.id
+
+(* The chunks holding records for obj, for partial inspection. *)
+let chunks_for_object index obj =
+  Array.to_list index.chunks
+  |> List.mapi (fun i chunk -> (i, chunk))
+  |> List.filter_map (fun (i, chunk) ->
+         match chunk.objects with
+         | Some (first, last)
+           when Int64.unsigned_compare first obj <= 0
+                && Int64.unsigned_compare obj last <= 0 ->
+             Some i
+         | _ -> None)
+
+(* Write the verified chunks in order to fd, reassembling the stream. *)
+let cat dir index fd =
+  match
+    unix_error @@ fun () ->
+    let rec loop i =
+      if i = Array.length index.chunks then Ok ()
+      else
+        let chunk = index.chunks.(i) in
+        let data = read_file (Filename.concat dir (chunk_name i)) in
+        if not (chunk_matches chunk data) then
+          Error
+            (EzfsBadStream, Printf.sprintf "chunk %d does not match index" i)
+        else (
+          Send_stream.really_write fd data 0 chunk.length;
+          loop (i + 1))
+    in
+    loop 0
+  with
+  | Ok () -> Ok ()
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot read archive '%s'" dir in
+      Error (e, what, why)
+
+(*
+ * Receive the archived stream into snapname.  The stream is written to the
+ * receive through a pipe, so the application should ignore SIGPIPE for a
+ * failed receive to be reported rather than terminate the process.
+ *)
+let receive handle dir index snapname force =
+  let recv_r, recv_w = Unix.pipe ~cloexec:true () in
+  let writer =
+    Domain.spawn (fun () ->
+        let result = cat dir index recv_w in
+        Unix.close recv_w;
+        result)
+  in
+  let received = Zfs.receive handle snapname None recv_r force false in
+  Unix.close recv_r;
+  match (received, Domain.join writer) with
+  | Ok _, Ok () -> Ok ()
+  (* A failed receive shows up on the writing side as a broken pipe. *)
+  | Error e, Error (EzfsIo, _, _) -> Error e
+  | _, Error e -> Error e
+  | Error e, Ok () -> Error e
@@ -0,0 +1,205 @@
+open Bigarray
+
+(*
+ * Collection of user, group and project accounting across the filesystems
+ * of a tree.  The userspace_many pagination loops, one per filesystem and
+ * property, run concurrently on a bounded number of domains, each with its
+ * own handle, and their results are merged into per-principal aggregates.
+ * Each loop copies its pages straight into columns, so a filesystem with
+ * millions of principals costs no allocation per entry until the merge.
+ *
+ * The per-filesystem results are kept between runs together with the
+ * written and used values they were collected at.  A refresh only pages
+ * through filesystems where either changed, and reuses the rest.
+ *)
+
+type principal = { prop : Userquota_prop.t; domain : string; rid : int }
+type aggregate = { space : int64; datasets : int }
+
+(* The accounting set of one property of a filesystem. *)
+type usage = {
+  prop : Userquota_prop.t;
+  domains : string array; (* indexed by domain_ids *)
+  rids : int array;
+  domain_ids : int array;
+  spaces : (int64, int64_elt, c_layout) Array1.t;
+}
+
+type dataset = { written : int64; used : int64; usage : usage list }
+
+type t = {
+  props : Userquota_prop.t list;
+  datasets : (string, dataset) Hashtbl.t;
+}
+
+type report = {
+  aggregates : (principal, aggregate) Hashtbl.t;
+  refreshed : int; (* filesystems paged through *)
+  reused : int; (* filesystems unchanged since the last run *)
+  seconds : float;
+}
+
+let default_props = Userquota_prop.[ Userused; Groupused; Projectused ]
+let create props = { props; datasets = Hashtbl.create 64 }
+
+let space props name = Option.value ~default:0L (Zfs.uint64_prop props name)
+
+(* Filesystems under root with their written and used values. *)
+let filesystems handle root =
+  let ( let* ) = Result.bind in
+  let rec walk name acc =
+    let rec children cookie acc =
+      let* next = Zfs.dataset_list_next handle name cookie in
+      match next with
+      | Some (child, stats, props, cookie) ->
+          let* acc =
+            if stats.Types.objset_type = Types.ObjsetTypeZfs then
+              walk child
+                ((child, space props "written", space props "used") :: acc)
+            else Ok acc
+          in
+          children cookie acc
+      | None -> Ok acc
+    in
+    children 0L acc
+  in
+  let* _stats, props = Zfs.stats handle root in
+  let* acc = walk root [ (root, space props "written", space props "used") ] in
+  Ok (List.rev acc)
+
+(*
+ * Page through the accounting set of prop in name.  A filesystem or pool
+ * too old to track prop has nothing to report.
+ *)
+let collect_one handle (name, prop) =
+  let page = Userspace.create_page Userspace.default_capacity in
+  let domains = Userspace.create_domains () in
+  let length = ref 0 in
+  let rids = ref [||] in
+  let domain_ids = ref [||] in
+  let spaces = ref (Array1.create int64 c_layout 0) in
+  let reserve n =
+    let capacity = Array.length !rids in
+    if n > capacity then (
+      let capacity = max n (2 * capacity) in
+      let grow column =
+        let grown = Array.make capacity 0 in
+        Array.blit column 0 grown 0 !length;
+        grown
+      in
+      rids := grow !rids;
+      domain_ids := grow !domain_ids;
+      let grown = Array1.create int64 c_layout capacity in
+      Array1.blit (Array1.sub !spaces 0 !length) (Array1.sub grown 0 !length);
+      spaces := grown)
+  in
+  Userspace.iter handle name prop domains page (fun page ->
+      let n = page.Userspace.length in
+      reserve (!length + n);
+      for i = 0 to n - 1 do
+        !rids.(!length + i) <- Userspace.rid page i;
+        !domain_ids.(!length + i) <- Userspace.domain_id page i;
+        !spaces.{!length + i} <- Userspace.space page i
+      done;
+      length := !length + n)
+  |> function
+  | Ok () ->
+      Ok
+        {
+          prop;
+          domains = domains.Userspace.names;
+          rids = Array.sub !rids 0 !length;
+          domain_ids = Array.sub !domain_ids 0 !length;
+          spaces = Array1.sub !spaces 0 !length;
+        }
+  | Error (Error.EzfsBadVersion, _, _) ->
+      Ok
+        {
+          prop;
+          domains = [||];
+          rids = [||];
+          domain_ids = [||];
+          spaces = Array1.create int64 c_layout 0;
+        }
+  | Error e -> Error e
+
+let aggregate t =
+  let aggregates = Hashtbl.create 1024 in
+  let add usage =
+    for i = 0 to Array.length usage.rids - 1 do
+      let domain = usage.domains.(usage.domain_ids.(i)) in
+      let principal = { prop = usage.prop; domain; rid = usage.rids.(i) } in
+      let space = usage.spaces.{i} in
+      let total =
+        match Hashtbl.find_opt aggregates principal with
+        | Some { space = total; datasets } ->
+            { space = Int64.add total space; datasets = datasets + 1 }
+        | None -> { space; datasets = 1 }
+      in
+      Hashtbl.replace aggregates principal total
+    done
+  in
+  Hashtbl.iter (fun _name dataset -> List.iter add dataset.usage) t.datasets;
+  aggregates
+
+(*
+ * Refresh t from the filesystems under root using up to jobs domains and
+ * report the per-principal totals.  Filesystems that no longer exist are
+ * forgotten.
+ *)
+let refresh jobs t root =
+  let ( let* ) = Result.bind in
+  let start = Unix.gettimeofday () in
+  let handle = Ioctls.open_handle () in
+  let* filesystems = filesystems handle root in
+  let changed =
+    List.filter
+      (fun (name, written, used) ->
+        match Hashtbl.find_opt t.datasets name with
+        | Some dataset ->
+            not
+              (Int64.equal dataset.written written
+              && Int64.equal dataset.used used)
+        | None -> true)
+      filesystems
+  in
+  let tasks =
+    List.concat_map
+      (fun (name, _, _) -> List.map (fun prop -> (name, prop)) t.props)
+      changed
+    |> Array.of_list
+  in
+  let results = Parallel.map jobs collect_one tasks in
+  let collected = Hashtbl.create (List.length changed) in
+  let* () =
+    Array.fold_left
+      (fun acc ((name, _prop), result) ->
+        let* () = acc in
+        let* usage = result in
+        let previous =
+          Option.value ~default:[] (Hashtbl.find_opt collected name)
+        in
+        Hashtbl.replace collected name (usage :: previous);
+        Ok ())
+      (Ok ())
+      (Array.map2 (fun task result -> (task, result)) tasks results)
+  in
+  let live = Hashtbl.create (List.length filesystems) in
+  List.iter (fun (name, _, _) -> Hashtbl.replace live name ()) filesystems;
+  Hashtbl.filter_map_inplace
+    (fun name dataset -> if Hashtbl.mem live name then Some dataset else None)
+    t.datasets;
+  List.iter
+    (fun (name, written, used) ->
+      let usage =
+        Option.value ~default:[] (Hashtbl.find_opt collected name)
+      in
+      Hashtbl.replace t.datasets name { written; used; usage })
+    changed;
+  Ok
+    {
+      aggregates = aggregate t;
+      refreshed = List.length changed;
+      reused = List.length filesystems - List.length changed;
+      seconds = Unix.gettimeofday () -. start;
+    }
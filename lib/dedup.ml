@@ -0,0 +1,256 @@
+open Error
+
+(*
+ * Offline deduplication of stored send streams.  WRITE payloads are kept
+ * once in a block store shared by all streams, addressed by their SHA-256,
+ * and a stream is rewritten as a container where each WRITE payload is
+ * replaced by the digest of its block.  Rehydrating a container gives back
+ * the original stream byte for byte.
+ *
+ * The block store is a directory holding an append-only "blocks" file and
+ * an "index" file of fixed size entries (digest, offset, length) that is
+ * loaded into a hash table when the store is opened.  Index entries are
+ * held back until the blocks file has been synced and are then appended
+ * together, so a crash can leave unreferenced data at the end of the
+ * blocks file but never a dangling index entry.
+ *
+ * A container is the container magic followed by one entry per record: a
+ * tag byte, the record header, then the payload (tag 0) or the digest of
+ * the payload (tag 1).
+ *)
+
+let container_magic = "ZSTRDDP1"
+let digest_size = 32
+let entry_size = digest_size + 8 + 8
+let tag_literal = 0
+let tag_reference = 1
+
+type store = {
+  blocks : Unix.file_descr;
+  index : Unix.file_descr;
+  table : (string, int * int) Hashtbl.t; (* digest -> offset, length *)
+  pending : Buffer.t; (* index entries of blocks not yet synced *)
+  mutable blocks_size : int;
+}
+
+type stats = {
+  stream_bytes : int; (* size of the original stream *)
+  container_bytes : int;
+  write_bytes : int; (* WRITE payload bytes in the stream *)
+  new_block_bytes : int; (* payload bytes added to the block store *)
+  seconds : float;
+}
+
+let open_store dir =
+  match
+    unix_error @@ fun () ->
+    (try Unix.mkdir dir 0o755 with Unix.Unix_error (Unix.EEXIST, _, _) -> ());
+    let flags = [ Unix.O_RDWR; Unix.O_CREAT; Unix.O_CLOEXEC ] in
+    let blocks = Unix.openfile (Filename.concat dir "blocks") flags 0o644 in
+    let index = Unix.openfile (Filename.concat dir "index") flags 0o644 in
+    let blocks_size = (Unix.fstat blocks).Unix.st_size in
+    let index_size = (Unix.fstat index).Unix.st_size in
+    let entries = Bytes.create index_size in
+    let n = Send_stream.really_read index entries 0 index_size in
+    let table = Hashtbl.create (max 1024 (n / entry_size)) in
+    for i = 0 to (n / entry_size) - 1 do
+      let off = i * entry_size in
+      let digest = Bytes.sub_string entries off digest_size in
+      let offset = Int64.to_int @@ Bytes.get_int64_le entries (off + 32) in
+      let length = Int64.to_int @@ Bytes.get_int64_le entries (off + 40) in
+      if offset + length <= blocks_size then
+        Hashtbl.replace table digest (offset, length)
+    done;
+    (* Drop a partial entry left by a crash. *)
+    let valid = n / entry_size * entry_size in
+    Unix.ftruncate index valid;
+    ignore @@ Unix.lseek index valid Unix.SEEK_SET;
+    Ok { blocks; index; table; pending = Buffer.create 4096; blocks_size }
+  with
+  | Ok store -> Ok store
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot open block store '%s'" dir in
+      Error (e, what, why)
+
+(* Sync the blocks file, then append the index entries of its new blocks. *)
+let sync_store store =
+  let n = Buffer.length store.pending in
+  if n > 0 then (
+    Unix.fsync store.blocks;
+    Send_stream.really_write store.index (Buffer.to_bytes store.pending) 0 n;
+    Buffer.clear store.pending)
+
+let close_store store =
+  Fun.protect
+    ~finally:(fun () ->
+      Unix.close store.blocks;
+      Unix.close store.index)
+    (fun () -> sync_store store)
+
+let add_block store digest payload =
+  let length = Bytes.length payload in
+  let offset = store.blocks_size in
+  ignore @@ Unix.lseek store.blocks offset Unix.SEEK_SET;
+  Send_stream.really_write store.blocks payload 0 length;
+  store.blocks_size <- offset + length;
+  let entry = Bytes.create entry_size in
+  Bytes.blit_string digest 0 entry 0 digest_size;
+  Bytes.set_int64_le entry 32 (Int64.of_int offset);
+  Bytes.set_int64_le entry 40 (Int64.of_int length);
+  Buffer.add_bytes store.pending entry;
+  Hashtbl.replace store.table digest (offset, length)
+
+let read_block store digest =
+  match Hashtbl.find_opt store.table digest with
+  | Some (offset, length) ->
+      let payload = Bytes.create length in
+      ignore @@ Unix.lseek store.blocks offset Unix.SEEK_SET;
+      if Send_stream.really_read store.blocks payload 0 length < length then
+        Error (EzfsBadStream, "block store is truncated")
+      else Ok payload
+  | None -> Error (EzfsBadStream, "block missing from block store")
+
+(* Rewrite the stream read from src as a container written to dst. *)
+let dedup store src dst =
+  let ( let* ) = Result.bind in
+  let start = Unix.gettimeofday () in
+  match
+    unix_error @@ fun () ->
+    let r = Send_stream.reader src in
+    let tag = Bytes.create 1 in
+    let write_bytes = ref 0 in
+    let new_block_bytes = ref 0 in
+    let container_bytes = ref (String.length container_magic) in
+    let emit buf =
+      Send_stream.really_write dst buf 0 (Bytes.length buf);
+      container_bytes := !container_bytes + Bytes.length buf
+    in
+    emit (Bytes.of_string container_magic);
+    let rec loop () =
+      let* next = Send_stream.next r in
+      match next with
+      | Some record ->
+          (match record.Send_stream.rtype with
+          | Send_stream.DrrWrite ->
+              let payload = record.payload in
+              let length = Bytes.length payload in
+              let digest = Util.sha256 payload 0 length in
+              if not (Hashtbl.mem store.table digest) then (
+                add_block store digest payload;
+                new_block_bytes := !new_block_bytes + length);
+              write_bytes := !write_bytes + length;
+              Bytes.set_uint8 tag 0 tag_reference;
+              emit tag;
+              emit record.header;
+              emit (Bytes.unsafe_of_string digest)
+          | _ ->
+              Bytes.set_uint8 tag 0 tag_literal;
+              emit tag;
+              emit record.header;
+              emit record.payload);
+          loop ()
+      | None ->
+          Ok
+            {
+              stream_bytes = r.Send_stream.offset;
+              container_bytes = !container_bytes;
+              write_bytes = !write_bytes;
+              new_block_bytes = !new_block_bytes;
+              seconds = Unix.gettimeofday () -. start;
+            }
+    in
+    let result = loop () in
+    sync_store store;
+    result
+  with
+  | Ok stats -> Ok stats
+  | Error (e, why) ->
+      let what = "cannot deduplicate stream" in
+      Error (e, what, why)
+
+(* Write the original stream of the container read from src to dst. *)
+let rehydrate store src dst =
+  let ( let* ) = Result.bind in
+  let start = Unix.gettimeofday () in
+  match
+    unix_error @@ fun () ->
+    let truncated = Error (EzfsBadStream, "container is truncated") in
+    let magic = Bytes.create (String.length container_magic) in
+    let* () =
+      let n = Send_stream.really_read src magic 0 (Bytes.length magic) in
+      if n = Bytes.length magic && Bytes.to_string magic = container_magic
+      then Ok ()
+      else Error (EzfsBadStream, "not a deduplicated stream container")
+    in
+    let r = Send_stream.reader src in
+    let tag = Bytes.create 1 in
+    let header = Bytes.create Send_stream.drr_size in
+    let digest = Bytes.create digest_size in
+    let stream_bytes = ref 0 in
+    let container_bytes = ref (Bytes.length magic) in
+    let write_bytes = ref 0 in
+    let emit buf =
+      Send_stream.really_write dst buf 0 (Bytes.length buf);
+      stream_bytes := !stream_bytes + Bytes.length buf
+    in
+    let rec loop () =
+      match Send_stream.really_read src tag 0 1 with
+      | 0 ->
+          Ok
+            {
+              stream_bytes = !stream_bytes;
+              container_bytes = !container_bytes;
+              write_bytes = !write_bytes;
+              new_block_bytes = 0;
+              seconds = Unix.gettimeofday () -. start;
+            }
+      | _ ->
+          let drr_size = Send_stream.drr_size in
+          if Send_stream.really_read src header 0 drr_size < drr_size then
+            truncated
+          else
+            let* _rtype, length = Send_stream.decode_header r header in
+            let* payload =
+              match Bytes.get_uint8 tag 0 with
+              | t when t = tag_literal ->
+                  let payload = Bytes.create length in
+                  if Send_stream.really_read src payload 0 length < length then
+                    truncated
+                  else (
+                    container_bytes := !container_bytes + length;
+                    Ok payload)
+              | t when t = tag_reference ->
+                  if Send_stream.really_read src digest 0 digest_size
+                     < digest_size
+                  then truncated
+                  else
+                    let* payload = read_block store (Bytes.to_string digest) in
+                    container_bytes := !container_bytes + digest_size;
+                    write_bytes := !write_bytes + length;
+                    if Bytes.length payload != length then
+                      Error (EzfsBadStream, "block has the wrong length")
+                    else Ok payload
+              | _ -> Error (EzfsBadStream, "container has an invalid tag")
+            in
+            container_bytes := !container_bytes + 1 + drr_size;
+            emit header;
+            emit payload;
+            loop ()
+    in
+    loop ()
+  with
+  | Ok stats -> Ok stats
+  | Error (e, why) ->
+      let what = "cannot rehydrate stream" in
+      Error (e, what, why)
+
+(* Stream bytes per container and new block byte. *)
+let ratio stats =
+  let stored = stats.container_bytes + stats.new_block_bytes in
+  if stored = 0 then 1.
+  else Float.of_int stats.stream_bytes /. Float.of_int stored
+
+(* Stream bytes per second, in either direction. *)
+let throughput stats =
+  if stats.seconds > 0. then Float.of_int stats.stream_bytes /. stats.seconds
+  else 0.
@@ -0,0 +1,195 @@
+open Error
+
+(*
+ * Streaming `zfs diff`.  The diff ioctl writes dmu_diff_record entries (a
+ * type and an inclusive range of object numbers) to a pipe from its own
+ * domain.  The records are read as they come, the objects they cover are
+ * gathered into batches, and each batch is resolved to paths and stats in
+ * both snapshots by a pool of domains before its events are delivered in
+ * object order.
+ *
+ * The kernel resolves full paths itself, so rather than directory prefixes
+ * the resolver caches whole object resolutions.  A resolver shared by
+ * successive diffs (a@1 to a@2, then a@2 to a@3) resolves the objects of
+ * the snapshot they have in common only once.  A live filesystem as tosnap
+ * is resolved afresh by every diff.
+ *)
+
+type event =
+  | Added of string * Types.stat
+  | Removed of string * Types.stat
+  | Modified of string * Types.stat
+  | Renamed of string * string * Types.stat (* from, to *)
+
+let ddr_size = 24 (* sizeof (dmu_diff_record_t) *)
+let ddr_inuse = 2L
+let ddr_free = 4L
+let batch_size = 1024
+
+let s_ifmt = 0o170000L
+let s_ifdir = 0o040000L
+let shares_dir = ".zfs/shares"
+
+(*
+ * Events for an object in use in tosnap, as write_inuse_diffs_one in
+ * libzfs classifies them.  An object whose type changed counts as a new
+ * one, an unchanged ctime means nothing happened, and a file whose link
+ * count changed is reported as modified under the name libzfs prints.
+ *)
+let inuse_events from to_ =
+  let fmt stat = Int64.logand stat.Types.mode s_ifmt in
+  match (from, to_) with
+  | None, None -> []
+  | None, Some (path, stat) -> [ Added (path, stat) ]
+  | Some (path, stat), None -> [ Removed (path, stat) ]
+  | Some (fpath, fstat), Some (tpath, tstat) ->
+      let fmode = fmt fstat and tmode = fmt tstat in
+      let change =
+        if
+          Int64.equal fmode s_ifdir || Int64.equal tmode s_ifdir
+          || Int64.equal fstat.Types.links 0L || Int64.equal tstat.links 0L
+        then 0L
+        else Int64.sub tstat.links fstat.links
+      in
+      if
+        (not (Int64.equal fstat.gen tstat.gen))
+        || not (Int64.equal fmode tmode)
+      then [ Removed (fpath, fstat); Added (tpath, tstat) ]
+      else if fstat.ctime = tstat.ctime then []
+      else if Int64.compare change 0L > 0 then [ Modified (fpath, tstat) ]
+      else if Int64.compare change 0L < 0 then [ Modified (tpath, tstat) ]
+      else if String.equal fpath tpath then [ Modified (tpath, tstat) ]
+      else [ Renamed (fpath, tpath, tstat) ]
+
+(*
+ * The object of the shares directory of the filesystem mounted on
+ * mountpoint, which libzfs leaves out of a diff.
+ *)
+let shares_object mountpoint =
+  match Unix.stat (Filename.concat mountpoint shares_dir) with
+  | st -> Some (Int64.of_int st.Unix.st_ino)
+  | exception Unix.Unix_error (_, _, _) -> None
+
+let free_events from =
+  match from with Some (path, stat) -> [ Removed (path, stat) ] | None -> []
+
+let diff_error = function
+  | Unix.EXDEV ->
+      (EzfsDiff, "not an earlier snapshot from the same filesystem")
+  | Unix.EPERM ->
+      (EzfsDiff, "the user lacks permission to run zfs diff")
+  | errno -> zfs_standard_error errno
+
+(*
+ * Call f on each change between fromsnap and tosnap, resolving objects with
+ * resolver.  fromsnap must be an earlier snapshot of the same
+ * filesystem, and tosnap a later snapshot or the filesystem itself.  When
+ * the filesystem is mounted on mountopt its shares directory is skipped.
+ *)
+let iter resolver fromsnap tosnap mountopt f =
+  let ( let* ) = Result.bind in
+  let shares = Option.bind mountopt shares_object in
+  let handle = Ioctls.open_handle () in
+  let diff_r, diff_w = Unix.pipe ~cloexec:true () in
+  let differ =
+    Domain.spawn (fun () ->
+        let handle = Ioctls.open_handle () in
+        let result = Ioctls.diff handle tosnap fromsnap diff_w in
+        Unix.close diff_w;
+        result)
+  in
+  let flush batch =
+    let objects = Array.of_list (List.rev batch) in
+    let requests =
+      Array.concat_map
+        (fun (free, obj) ->
+          let from = { Resolver.dataset = fromsnap; obj; gen = None } in
+          if free then [| from |]
+          else [| from; { from with dataset = tosnap } |])
+        objects
+    in
+    let resolved = Resolver.resolve_batch resolver requests in
+    let rec deliver i k =
+      if i = Array.length objects then Ok ()
+      else
+        let free, _obj = objects.(i) in
+        match
+          if free then Result.map free_events resolved.(k)
+          else
+            let* from = resolved.(k) in
+            let* to_ = resolved.(k + 1) in
+            Ok (inuse_events from to_)
+        with
+        | Ok events ->
+            List.iter f events;
+            deliver (i + 1) (if free then k + 1 else k + 2)
+        | Error (e, _what, why) -> Error (e, why)
+    in
+    deliver 0 0
+  in
+  let add batch n item =
+    if n + 1 = batch_size then
+      let* () = flush (item :: batch) in
+      Ok ([], 0)
+    else Ok (item :: batch, n + 1)
+  in
+  (* Objects freed since fromsnap, skipping holes with next_obj. *)
+  let rec add_free batch n after last =
+    match Ioctls.next_obj handle fromsnap after with
+    | Ok (Some next) when Int64.unsigned_compare next last <= 0 ->
+        let* batch, n = add batch n (true, next) in
+        add_free batch n next last
+    | Ok _ -> Ok (batch, n)
+    | Error errno -> Error (zfs_standard_error errno)
+  in
+  let rec add_inuse batch n obj last =
+    if Int64.unsigned_compare obj last > 0 then Ok (batch, n)
+    else if Some obj = shares then add_inuse batch n (Int64.succ obj) last
+    else
+      let* batch, n = add batch n (false, obj) in
+      add_inuse batch n (Int64.succ obj) last
+  in
+  let record = Bytes.create ddr_size in
+  let rec loop batch n =
+    match Send_stream.really_read diff_r record 0 ddr_size with
+    | 0 -> flush batch
+    | len when len < ddr_size ->
+        Error (EzfsDiffData, "diff stream is truncated")
+    | _ ->
+        let ddr_type = Bytes.get_int64_ne record 0 in
+        let first = Bytes.get_int64_ne record 8 in
+        let last = Bytes.get_int64_ne record 16 in
+        let* batch, n =
+          if Int64.equal ddr_type ddr_inuse then add_inuse batch n first last
+          else if Int64.equal ddr_type ddr_free then
+            add_free batch n (Int64.max 0L (Int64.pred first)) last
+          else Ok (batch, n)
+        in
+        loop batch n
+    | exception Unix.Unix_error (errno, _, _) ->
+        Error (zfs_standard_error errno)
+  in
+  let finish () =
+    Unix.close diff_r;
+    Domain.join differ
+  in
+  let result =
+    try loop [] 0
+    with e ->
+      ignore (finish ());
+      raise e
+  in
+  let diffed = finish () in
+  (* Closing the pipe early makes the diff ioctl fail, report why. *)
+  match
+    match (result, diffed) with
+    | Error e, _ -> Error e
+    | Ok (), Error errno -> Error (diff_error errno)
+    | Ok (), Ok () -> Ok ()
+  with
+  | Ok () -> Ok ()
+  | Error (e, why) ->
+      let what =
+        Printf.sprintf "unable to diff '%s' and '%s'" fromsnap tosnap
+      in
+      Error (e, what, why)
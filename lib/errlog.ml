@@ -0,0 +1,163 @@
+open Error
+
+(*
+ * Decoding of the pool error log.  The log holds one bookmark per damaged
+ * block, so a single damaged file can contribute thousands of entries.
+ * Bookmarks are first collapsed to distinct (objset, object) pairs, each
+ * objset is named with one dsobj_to_dsname call, and the objects are then
+ * resolved to paths by a Resolver.  Names are cached, and so are the paths
+ * of objects in snapshots, so a monitor polling the log of the same pool
+ * only resolves new entries and those of live filesystems, whose objects
+ * can be renamed or reused between polls.
+ *)
+
+type entry = {
+  dsobj : int64;
+  obj : int64;
+  dataset : string option; (* None if the objset no longer exists *)
+  path : string option; (* None if the object no longer exists *)
+  blocks : int; (* damaged blocks of the object in the log *)
+}
+
+type cache = {
+  names : (string * int64, string option) Lru.t;
+  resolver : Resolver.t;
+}
+
+let create_cache jobs capacity =
+  { names = Lru.create capacity; resolver = Resolver.create jobs capacity }
+
+let close_cache cache = Resolver.close cache.resolver
+
+(* Distinct (objset, object) pairs in order, with their block counts. *)
+let collapse bookmarks =
+  let counts = Hashtbl.create 1024 in
+  Array.iter
+    (fun zb ->
+      let key = (zb.Types.objset, zb.Types.obj) in
+      let n = Option.value ~default:0 (Hashtbl.find_opt counts key) in
+      Hashtbl.replace counts key (n + 1))
+    bookmarks;
+  let pairs = Array.of_seq (Hashtbl.to_seq counts) in
+  Array.sort
+    (fun ((ds1, obj1), _) ((ds2, obj2), _) ->
+      match Int64.unsigned_compare ds1 ds2 with
+      | 0 -> Int64.unsigned_compare obj1 obj2
+      | c -> c)
+    pairs;
+  pairs
+
+(*
+ * Look up each of keys, from lru where possible and otherwise with lookup
+ * on up to jobs domains, adding the new results to lru.
+ *)
+let fill jobs lru lookup keys =
+  let ( let* ) = Result.bind in
+  let found = Hashtbl.create (List.length keys) in
+  let missing =
+    List.filter
+      (fun key ->
+        match Lru.find_opt lru key with
+        | Some value ->
+            Hashtbl.replace found key value;
+            false
+        | None -> true)
+      keys
+    |> Array.of_list
+  in
+  let results = Parallel.map jobs lookup missing in
+  let rec add i =
+    if i = Array.length missing then Ok found
+    else
+      let* value = results.(i) in
+      Lru.add lru missing.(i) value;
+      Hashtbl.replace found missing.(i) value;
+      add (i + 1)
+  in
+  add 0
+
+let lookup_name poolname handle (_, dsobj) =
+  match Ioctls.dsobj_to_dsname handle poolname dsobj with
+  | Ok name -> Ok (Some name)
+  | Error Unix.ENOENT -> Ok None
+  | Error errno -> Error (zpool_standard_error errno)
+
+(* The path of each of objects, None if it no longer exists. *)
+let lookup_paths resolver objects =
+  let requests =
+    Array.map
+      (fun (dataset, obj) -> { Resolver.dataset; obj; gen = None })
+      objects
+  in
+  let resolved = Resolver.resolve_batch resolver requests in
+  let paths = Hashtbl.create (Array.length objects) in
+  let rec add i =
+    if i = Array.length objects then Ok paths
+    else
+      match resolved.(i) with
+      | Ok found ->
+          Hashtbl.replace paths objects.(i) (Option.map fst found);
+          add (i + 1)
+      | Error (e, _what, why) -> Error (e, why)
+  in
+  add 0
+
+(* Read and resolve the error log of poolname, sorted by objset and object. *)
+let resolve jobs cache handle poolname =
+  let ( let* ) = Result.bind in
+  match
+    let* bookmarks =
+      Ioctls.error_log handle poolname |> Result.map_error zpool_standard_error
+    in
+    let pairs = collapse bookmarks in
+    let dsobjs =
+      Array.fold_left
+        (fun acc ((dsobj, _), _) ->
+          match acc with
+          | last :: _ when Int64.equal last dsobj -> acc
+          | _ when Int64.equal dsobj 0L -> acc
+          | _ -> dsobj :: acc)
+        [] pairs
+    in
+    let* names =
+      fill jobs cache.names (lookup_name poolname)
+        (List.rev_map (fun dsobj -> (poolname, dsobj)) dsobjs)
+    in
+    let name dsobj =
+      Option.join (Hashtbl.find_opt names (poolname, dsobj))
+    in
+    let objects =
+      Array.to_list pairs
+      |> List.filter_map (fun ((dsobj, obj), _) ->
+             Option.map (fun dataset -> (dataset, obj)) (name dsobj))
+    in
+    let* paths = lookup_paths cache.resolver (Array.of_list objects) in
+    Ok
+      (Array.map
+         (fun ((dsobj, obj), blocks) ->
+           let dataset = name dsobj in
+           let path =
+             match dataset with
+             | Some dataset ->
+                 Option.join (Hashtbl.find_opt paths (dataset, obj))
+             | None -> None
+           in
+           { dsobj; obj; dataset; path; blocks })
+         pairs)
+  with
+  | Ok entries -> Ok entries
+  | Error (e, why) ->
+      let what =
+        Printf.sprintf "list of errors unavailable for pool '%s'" poolname
+      in
+      Error (e, what, why)
+
+(* The name zpool status prints for an entry. *)
+let describe entry =
+  match entry with
+  | { dsobj = 0L; obj; _ } -> Printf.sprintf "<metadata>:<0x%Lx>" obj
+  | { dataset = None; dsobj; obj; _ } ->
+      Printf.sprintf "<0x%Lx>:<0x%Lx>" dsobj obj
+  | { dataset = Some dataset; path = Some path; _ } -> dataset ^ ":" ^ path
+  | { dataset = Some dataset; path = None; obj; _ } ->
+      Printf.sprintf "%s:<0x%Lx>" dataset obj
@@ -555,6 +555,11 @@ let zfs_standard_error errno =
   in
   match error_info with e, Some msg -> (e, msg) | e, None -> (e, to_string e)
 
+(* Run f, which returns a result, turning a Unix_error it raises into one. *)
+let unix_error f =
+  try f ()
+  with Unix.Unix_error (errno, _, _) -> Error (zfs_standard_error errno)
+
 let zpool_standard_error errno =
   let error_info =
     match zfs_common_error errno with
@@ -0,0 +1,100 @@
+(*
+ * A manager for the user holds a process takes, e.g. to keep the snapshots
+ * of a replication from being destroyed under it.  Holds are taken and
+ * released in batches of one ioctl per pool, and the snapshots held under
+ * each tag are indexed in memory so callers need no get_holds round trips.
+ *
+ * A temporary manager ties its holds to a cleanup fd, a descriptor of
+ * /dev/zfs opened exclusively, so that the kernel releases them when the
+ * manager is closed or the process dies.
+ *)
+
+type t = {
+  cleanup_fd : Unix.file_descr option;
+  index : (string, (string, unit) Hashtbl.t) Hashtbl.t; (* tag -> snaps *)
+  lock : Mutex.t;
+}
+
+let create temporary =
+  let cleanup_fd =
+    if temporary then
+      Some
+        (Unix.openfile "/dev/zfs"
+           [ Unix.O_RDWR; Unix.O_EXCL; Unix.O_CLOEXEC ]
+           0)
+    else None
+  in
+  { cleanup_fd; index = Hashtbl.create 8; lock = Mutex.create () }
+
+(* Closing a temporary manager drops all of its holds. *)
+let close t =
+  Option.iter Unix.close t.cleanup_fd;
+  Mutex.lock t.lock;
+  if Option.is_some t.cleanup_fd then Hashtbl.reset t.index;
+  Mutex.unlock t.lock
+
+let update t tag f =
+  Mutex.lock t.lock;
+  let snaps =
+    match Hashtbl.find_opt t.index tag with
+    | Some snaps -> snaps
+    | None ->
+        let snaps = Hashtbl.create 64 in
+        Hashtbl.replace t.index tag snaps;
+        snaps
+  in
+  f snaps;
+  if Hashtbl.length snaps = 0 then Hashtbl.remove t.index tag;
+  Mutex.unlock t.lock
+
+let failed failures =
+  let names = Hashtbl.create (List.length failures) in
+  List.iter
+    (fun failure -> Hashtbl.replace names failure.Zfs.snapname ())
+    failures;
+  names
+
+(* Hold snapnames with tag, returning the snapshots that could not be. *)
+let hold handle t tag snapnames =
+  let failures = Zfs.hold_many handle tag snapnames t.cleanup_fd in
+  let failed = failed failures in
+  update t tag (fun snaps ->
+      List.iter
+        (fun name ->
+          if not (Hashtbl.mem failed name) then Hashtbl.replace snaps name ())
+        snapnames);
+  failures
+
+(* Release tag on snapnames, returning the snapshots that could not be. *)
+let release handle t tag snapnames =
+  let failures = Zfs.release_many handle tag snapnames in
+  let failed = failed failures in
+  update t tag (fun snaps ->
+      List.iter
+        (fun name ->
+          if not (Hashtbl.mem failed name) then Hashtbl.remove snaps name)
+        snapnames);
+  failures
+
+let held t tag =
+  Mutex.lock t.lock;
+  let snaps =
+    match Hashtbl.find_opt t.index tag with
+    | Some snaps -> List.of_seq (Hashtbl.to_seq_keys snaps)
+    | None -> []
+  in
+  Mutex.unlock t.lock;
+  List.sort String.compare snaps
+
+let is_held t tag snapname =
+  Mutex.lock t.lock;
+  let held =
+    match Hashtbl.find_opt t.index tag with
+    | Some snaps -> Hashtbl.mem snaps snapname
+    | None -> false
+  in
+  Mutex.unlock t.lock;
+  held
+
+(* Release everything held with tag. *)
+let release_tag handle t tag = release handle t tag (held t tag)
@@ -17,6 +17,7 @@
 #include <caml/threads.h>
 #include <caml/unixsupport.h>
 #include <caml/custom.h>
+#include <caml/bigarray.h>
 
 #define CONFIG_BUF_MINSIZE 262144
 
@@ -1386,10 +1387,10 @@ static const int zprop_errflags[] = {
 CAMLprim value
 caml_zfs_ioc_recv_native(value handle, value name, value props_opt,
     value override_opt, value snapname, value origin_opt, value desc,
-    value begin_rec, value force)
+    value begin_rec, value force, value resumable)
 {
 	CAMLparam5 (handle, name, props_opt, override_opt, snapname);
-	CAMLxparam4 (origin_opt, desc, begin_rec, force);
+	CAMLxparam5 (origin_opt, desc, begin_rec, force, resumable);
 	CAMLlocal5 (string, bytes, errflags, tuple, ret);
 	zfs_cmd_t zc = {"\0"};
 	int fd, err;
@@ -1436,6 +1437,7 @@ caml_zfs_ioc_recv_native(value handle, value name, value props_opt,
 	(void)memcpy(&zc.zc_begin_record, Bytes_val(begin_rec),
 	    sizeof zc.zc_begin_record);
 	zc.zc_guid = Bool_val(force);
+	zc.zc_resumable = Bool_val(resumable);
 	zc.zc_nvlist_dst_size = 256 * 1024;
 	zc.zc_nvlist_dst = (uint64_t)(uintptr_t)malloc(zc.zc_nvlist_dst_size);
 	if (zc.zc_nvlist_dst == 0) {
@@ -1473,7 +1475,7 @@ CAMLprim value
 caml_zfs_ioc_recv_bytecode(value *argv, int argn)
 {
 	return (caml_zfs_ioc_recv_native(argv[0], argv[1], argv[2], argv[3],
-	    argv[4], argv[5], argv[6], argv[7], argv[8]));
+	    argv[4], argv[5], argv[6], argv[7], argv[8], argv[9]));
 }
 
 /* Convert lzc_send_flag variant into LZC_SEND_* flag */
@@ -2303,6 +2305,108 @@ caml_zfs_ioc_userspace_many(value handle, value name, value prop, value count,
 	CAMLreturn (ret);
 }
 
+/*
+ * Like userspace_many, but the kernel writes into the caller's scratch
+ * buffer and the entries are decoded into columns: rids, spaces, and the
+ * index of each entry's domain in the array of distinct domains of the
+ * page that is returned with the cursor and count.  Pages usually hold a
+ * single domain, so the table of distinct domains is searched linearly.
+ */
+CAMLprim value
+caml_zfs_ioc_userspace_columns_native(value handle, value name, value prop,
+    value cursor, value scratch, value rids, value spaces, value domains)
+{
+	CAMLparam5 (handle, name, prop, cursor, scratch);
+	CAMLxparam3 (rids, spaces, domains);
+	CAMLlocal3 (table, tuple, ret);
+	zfs_cmd_t zc = {"\0"};
+	zfs_useracct_t *zu;
+	const char **distinct;
+	int32_t *rid_col, *domain_col;
+	int64_t *space_col;
+	size_t count;
+	uint_t len, ndistinct;
+	int fd, err;
+
+	fd = Devzfs_val(handle);
+	if (strlcpy(zc.zc_name, String_val(name), sizeof zc.zc_name)
+	    >= sizeof zc.zc_name) {
+		ret = caml_alloc(1, 1);
+		Store_field(ret, 0, caml_unix_error_of_code(ENAMETOOLONG));
+		CAMLreturn (ret);
+	}
+	count = Caml_ba_array_val(scratch)->dim[0] / sizeof (zfs_useracct_t);
+	count = MIN(count, Caml_ba_array_val(rids)->dim[0]);
+	count = MIN(count, Caml_ba_array_val(spaces)->dim[0]);
+	count = MIN(count, Caml_ba_array_val(domains)->dim[0]);
+	if (count == 0) {
+		ret = caml_alloc(1, 1);
+		Store_field(ret, 0, caml_unix_error_of_code(EINVAL));
+		CAMLreturn (ret);
+	}
+	zu = Caml_ba_data_val(scratch);
+	zc.zc_objset_type = Int_val(prop);
+	zc.zc_cookie = Int64_val(cursor);
+	zc.zc_nvlist_dst_size = count * sizeof (zfs_useracct_t);
+	zc.zc_nvlist_dst = (uint64_t)(uintptr_t)zu;
+	caml_release_runtime_system();
+	err = zfs_ioctl(fd, ZFS_IOC_USERSPACE_MANY, &zc);
+	caml_acquire_runtime_system();
+	if (err) {
+		ret = caml_alloc(1, 1);
+		Store_field(ret, 0, caml_unix_error_of_code(err));
+		CAMLreturn (ret);
+	}
+	len = zc.zc_nvlist_dst_size / sizeof (zfs_useracct_t);
+	distinct = malloc(MAX(len, 1) * sizeof (*distinct));
+	if (distinct == NULL) {
+		err = errno;
+		ret = caml_alloc(1, 1);
+		Store_field(ret, 0, caml_unix_error_of_code(err));
+		CAMLreturn (ret);
+	}
+	rid_col = Caml_ba_data_val(rids);
+	space_col = Caml_ba_data_val(spaces);
+	domain_col = Caml_ba_data_val(domains);
+	ndistinct = 0;
+	for (uint_t i = 0; i < len; i++) {
+		uint_t d;
+
+		for (d = 0; d < ndistinct; d++) {
+			if (strcmp(distinct[d], zu[i].zu_domain) == 0)
+				break;
+		}
+		if (d == ndistinct)
+			distinct[ndistinct++] = zu[i].zu_domain;
+		rid_col[i] = (int32_t)zu[i].zu_rid;
+		space_col[i] = (int64_t)zu[i].zu_space;
+		domain_col[i] = (int32_t)d;
+	}
+	if (ndistinct == 0) {
+		table = Atom(0);
+	} else {
+		table = caml_alloc_tuple(ndistinct);
+		for (uint_t d = 0; d < ndistinct; d++) {
+			Store_field(table, d, caml_copy_string(distinct[d]));
+		}
+	}
+	free(distinct);
+	tuple = caml_alloc_tuple(3);
+	Store_field(tuple, 0, caml_copy_int64(zc.zc_cookie));
+	Store_field(tuple, 1, Val_int(len));
+	Store_field(tuple, 2, table);
+	ret = caml_alloc(1, 0);
+	Store_field(ret, 0, tuple);
+	CAMLreturn (ret);
+}
+
+CAMLprim value
+caml_zfs_ioc_userspace_columns_bytecode(value *argv, int argn)
+{
+	return (caml_zfs_ioc_userspace_columns_native(argv[0], argv[1],
+	    argv[2], argv[3], argv[4], argv[5], argv[6], argv[7]));
+}
+
 CAMLprim value
 caml_zfs_ioc_userspace_upgrade(value handle, value name)
 {
@@ -2390,10 +2494,20 @@ caml_zfs_ioc_hold(value handle, value name, value args)
 		ret = caml_alloc(1, 1);
 		Store_field(ret, 0, tuple);
 	} else {
-		void *p = (void *)zc.zc_nvlist_dst;
-		free(p);
+		/*
+		 * Snapshots that do not exist are skipped rather than failing
+		 * the hold, and listed in the errlist.
+		 */
+		char *p = (char *)zc.zc_nvlist_dst;
 		ret = caml_alloc(1, 0);
-		Store_field(ret, 0, Val_unit);
+		if (zc.zc_nvlist_dst_filled) {
+			size_t len = (size_t)zc.zc_nvlist_dst_size;
+			bytes = caml_alloc_initialized_string(len, p);
+			Store_field(ret, 0, caml_alloc_some(bytes));
+		} else {
+			Store_field(ret, 0, Val_none);
+		}
+		free(p);
 	}
 	CAMLreturn (ret);
 }
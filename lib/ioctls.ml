@@ -164,7 +164,7 @@ external rename :
   rename_flag array ->
   (unit, string option * Unix.error) result = "caml_zfs_ioc_rename"
 
-(* recv handle name packed_props packed_override snapname origin fd begin_rec force *)
+(* recv handle name packed_props packed_override snapname origin fd begin_rec force resumable *)
 external recv :
   handle ->
   string ->
@@ -175,6 +175,7 @@ external recv :
   Unix.file_descr ->
   bytes ->
   bool ->
+  bool ->
   (int64 * zprop_errflag array * bytes, Unix.error) result
   = "caml_zfs_ioc_recv_bytecode" "caml_zfs_ioc_recv_native"
 
@@ -282,13 +283,30 @@ external userspace_many :
   int64 ->
   (int64 * useracct array, Unix.error) result = "caml_zfs_ioc_userspace_many"
 
+(* userspace_columns handle name prop cursor scratch rids spaces domains *)
+external userspace_columns :
+  handle ->
+  string ->
+  Userquota_prop.t ->
+  int64 ->
+  (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+  (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+  (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+  (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+  (int64 * int * string array, Unix.error) result
+  = "caml_zfs_ioc_userspace_columns_bytecode"
+    "caml_zfs_ioc_userspace_columns_native"
+
 (* userspace_upgrade handle name *)
 external userspace_upgrade : handle -> string -> (unit, Unix.error) result
   = "caml_zfs_ioc_userspace_upgrade"
 
 (* hold handle name packed_args *)
 external hold :
-  handle -> string -> bytes -> (unit, bytes option * Unix.error) result
+  handle ->
+  string ->
+  bytes ->
+  (bytes option, bytes option * Unix.error) result
   = "caml_zfs_ioc_hold"
 
 (* release handle name packed_args *)
@@ -1,8 +1,29 @@
+module Archive = Archive
+module Chargeback = Chargeback
 module Const = Const
+module Dedup = Dedup
+module Diff = Diff
+module Errlog = Errlog
 module Error = Error
+module Holds = Holds
 module Ioctls = Ioctls
+module Lru = Lru
+module Objects = Objects
+module Parallel = Parallel
+module Progress = Progress
+module Prop_table = Prop_table
+module Replicate = Replicate
+module Resolver = Resolver
+module Resume_token = Resume_token
+module Retention = Retention
+module Ring = Ring
+module Scanner = Scanner
+module Send_estimate = Send_estimate
+module Send_stream = Send_stream
+module Throttle = Throttle
 module Types = Types
 module Userquota_prop = Userquota_prop
+module Userspace = Userspace
 module Util = Util
 module Vdev_prop = Vdev_prop
 module Zfs = Zfs
@@ -0,0 +1,111 @@
+(*
+ * A bounded map evicting the least recently used binding, safe to share
+ * between domains.  Bindings are kept in a doubly linked list in order of
+ * use, so lookups, insertions and evictions are all constant time.
+ *)
+
+type ('k, 'v) node = {
+  key : 'k;
+  mutable value : 'v;
+  mutable newer : ('k, 'v) node option;
+  mutable older : ('k, 'v) node option;
+}
+
+type ('k, 'v) t = {
+  capacity : int;
+  table : ('k, ('k, 'v) node) Hashtbl.t;
+  lock : Mutex.t;
+  mutable newest : ('k, 'v) node option;
+  mutable oldest : ('k, 'v) node option;
+  mutable hits : int;
+  mutable misses : int;
+}
+
+let create capacity =
+  {
+    capacity = max 1 capacity;
+    table = Hashtbl.create (max 1 capacity);
+    lock = Mutex.create ();
+    newest = None;
+    oldest = None;
+    hits = 0;
+    misses = 0;
+  }
+
+let unlink t node =
+  (match node.newer with
+  | Some newer -> newer.older <- node.older
+  | None -> t.newest <- node.older);
+  (match node.older with
+  | Some older -> older.newer <- node.newer
+  | None -> t.oldest <- node.newer);
+  node.newer <- None;
+  node.older <- None
+
+let push t node =
+  node.older <- t.newest;
+  (match t.newest with
+  | Some newest -> newest.newer <- Some node
+  | None -> t.oldest <- Some node);
+  t.newest <- Some node
+
+let find_opt t key =
+  Mutex.lock t.lock;
+  let result =
+    match Hashtbl.find_opt t.table key with
+    | Some node ->
+        unlink t node;
+        push t node;
+        t.hits <- t.hits + 1;
+        Some node.value
+    | None ->
+        t.misses <- t.misses + 1;
+        None
+  in
+  Mutex.unlock t.lock;
+  result
+
+let add t key value =
+  Mutex.lock t.lock;
+  (match Hashtbl.find_opt t.table key with
+  | Some node ->
+      node.value <- value;
+      unlink t node;
+      push t node
+  | None ->
+      (if Hashtbl.length t.table >= t.capacity then
+         match t.oldest with
+         | Some oldest ->
+             unlink t oldest;
+             Hashtbl.remove t.table oldest.key
+         | None -> ());
+      let node = { key; value; newer = None; older = None } in
+      Hashtbl.replace t.table key node;
+      push t node);
+  Mutex.unlock t.lock
+
+let remove t key =
+  Mutex.lock t.lock;
+  (match Hashtbl.find_opt t.table key with
+  | Some node ->
+      unlink t node;
+      Hashtbl.remove t.table key
+  | None -> ());
+  Mutex.unlock t.lock
+
+let length t =
+  Mutex.lock t.lock;
+  let length = Hashtbl.length t.table in
+  Mutex.unlock t.lock;
+  length
+
+(* Fraction of lookups that hit, and the raw counts. *)
+let stats t =
+  Mutex.lock t.lock;
+  let hits = t.hits and misses = t.misses in
+  Mutex.unlock t.lock;
+  let lookups = hits + misses in
+  let ratio =
+    if lookups = 0 then 0. else Float.of_int hits /. Float.of_int lookups
+  in
+  (ratio, hits, misses)
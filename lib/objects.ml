@@ -0,0 +1,194 @@
+open Error
+
+(*
+ * Enumeration of the allocated objects of a dataset with next_obj.  The
+ * object number space, up to the highest allocated object found by a
+ * binary search, is cut into ranges that domains walk concurrently.  Each
+ * range runs ahead of the consumer by at most readahead batches, and the
+ * consumer takes the ranges in order, so objects are delivered in
+ * increasing order with bounded memory.  Objects may optionally be joined
+ * with their path and stats.
+ *)
+
+let batch_size = 4096
+let readahead = 4 (* batches buffered per range *)
+let ranges_per_job = 4
+
+type item = int64 * (string * Types.stat) option
+
+(* The batches of one range, from its walker to the consumer. *)
+type channel = {
+  batches : (item array, zfs_error * string) result Queue.t;
+  lock : Mutex.t;
+  changed : Condition.t;
+  mutable finished : bool;
+}
+
+let channel () =
+  {
+    batches = Queue.create ();
+    lock = Mutex.create ();
+    changed = Condition.create ();
+    finished = false;
+  }
+
+let push stop channel batch =
+  Mutex.lock channel.lock;
+  while Queue.length channel.batches >= readahead && not (Atomic.get stop) do
+    Condition.wait channel.changed channel.lock
+  done;
+  Queue.add batch channel.batches;
+  Condition.broadcast channel.changed;
+  Mutex.unlock channel.lock
+
+let finish channel =
+  Mutex.lock channel.lock;
+  channel.finished <- true;
+  Condition.broadcast channel.changed;
+  Mutex.unlock channel.lock
+
+(* The next batch of the range, or None once it is exhausted. *)
+let take channel =
+  Mutex.lock channel.lock;
+  while Queue.is_empty channel.batches && not channel.finished do
+    Condition.wait channel.changed channel.lock
+  done;
+  let batch = Queue.take_opt channel.batches in
+  Condition.broadcast channel.changed;
+  Mutex.unlock channel.lock;
+  batch
+
+let wake channel =
+  Mutex.lock channel.lock;
+  Condition.broadcast channel.changed;
+  Mutex.unlock channel.lock
+
+(*
+ * The highest allocated object number, 0 if the dataset has no objects.
+ * next_obj finds an object after obj exactly when obj is below it, so it is
+ * bracketed by doubling and then bisected.
+ *)
+let highest handle dataset =
+  let ( let* ) = Result.bind in
+  let below obj =
+    match Ioctls.next_obj handle dataset obj with
+    | Ok next -> Ok (Option.is_some next)
+    | Error errno -> Error (zfs_standard_error errno)
+  in
+  let rec bisect lo hi =
+    if Int64.sub hi lo <= 1L then Ok hi
+    else
+      let mid = Int64.add lo (Int64.div (Int64.sub hi lo) 2L) in
+      let* below = below mid in
+      if below then bisect mid hi else bisect lo mid
+  in
+  let rec grow lo =
+    let probe = Int64.max 1L (Int64.mul 2L lo) in
+    let* below = below probe in
+    if below then grow probe else bisect lo probe
+  in
+  let* any = below 0L in
+  if any then grow 0L else Ok 0L
+
+(* Split objects 1 to highest into at most n inclusive ranges. *)
+let ranges highest n =
+  let n = Int64.of_int (max 1 n) in
+  let span = Int64.max 1L (Int64.div (Int64.add highest n) n) in
+  let rec split first acc =
+    if Int64.compare first highest > 0 then Array.of_list (List.rev acc)
+    else
+      let last = Int64.min highest (Int64.pred (Int64.add first span)) in
+      split (Int64.succ last) ((first, last) :: acc)
+  in
+  split 1L []
+
+let resolve handle dataset obj =
+  match Ioctls.obj_to_stats handle dataset obj with
+  | Ok resolved -> Ok (Some resolved)
+  (* Freed since next_obj found it, or not a file (e.g. a ZAP of the ZPL). *)
+  | Error (Unix.ENOENT | Unix.EINVAL) -> Ok None
+  | Error errno -> Error (zfs_standard_error errno)
+
+(* Walk the objects of one range into its channel. *)
+let walk stop stats dataset handle (first, last) channel =
+  let flush batch =
+    if batch <> [] then push stop channel (Ok (Array.of_list (List.rev batch)))
+  in
+  let rec loop batch n after =
+    if Atomic.get stop then ()
+    else
+      match Ioctls.next_obj handle dataset after with
+      | Ok (Some obj) when Int64.unsigned_compare obj last <= 0 -> (
+          match if stats then resolve handle dataset obj else Ok None with
+          | Ok resolved when n + 1 = batch_size ->
+              flush ((obj, resolved) :: batch);
+              loop [] 0 obj
+          | Ok resolved -> loop ((obj, resolved) :: batch) (n + 1) obj
+          | Error e ->
+              flush batch;
+              push stop channel (Error e))
+      | Ok _ -> flush batch
+      | Error errno ->
+          flush batch;
+          push stop channel (Error (zfs_standard_error errno))
+  in
+  loop [] 0 (Int64.pred first);
+  finish channel
+
+(*
+ * Call f on each allocated object of dataset in increasing order, with its
+ * path and stats when stats is true, walking ranges on up to jobs domains.
+ * Returns the number of objects.
+ *)
+let iter jobs stats dataset f =
+  let ( let* ) = Result.bind in
+  match
+    let* highest = highest (Ioctls.open_handle ()) dataset in
+    let ranges = ranges highest (max 1 jobs * ranges_per_job) in
+    let channels = Array.map (fun _ -> channel ()) ranges in
+    let stop = Atomic.make false in
+    let next = Atomic.make 0 in
+    (* Ranges are taken in order, so the one the consumer waits on is
+       always being walked. *)
+    let walker handle =
+      let rec loop () =
+        let i = Atomic.fetch_and_add next 1 in
+        if i < Array.length ranges then (
+          if Atomic.get stop then finish channels.(i)
+          else walk stop stats dataset handle ranges.(i) channels.(i);
+          loop ())
+      in
+      loop ()
+    in
+    let walkers =
+      Domain.spawn (fun () ->
+          Parallel.spawn (min jobs (Array.length ranges)) walker)
+    in
+    let rec consume i count =
+      if i = Array.length channels then Ok count
+      else
+        match take channels.(i) with
+        | Some (Ok items) ->
+            Array.iter (fun (obj, resolved) -> f obj resolved) items;
+            consume i (count + Array.length items)
+        | Some (Error e) -> Error e
+        | None -> consume (i + 1) count
+    in
+    let stop_walkers () =
+      Atomic.set stop true;
+      Array.iter wake channels;
+      Domain.join walkers
+    in
+    let result =
+      try consume 0 0
+      with e ->
+        stop_walkers ();
+        raise e
+    in
+    stop_walkers ();
+    result
+  with
+  | Ok count -> Ok count
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot list objects of '%s'" dataset in
+      Error (e, what, why)
@@ -0,0 +1,131 @@
+(*
+ * Fan work out over a bounded number of domains.  Each domain opens its own
+ * handle so ioctls issued by different domains do not share a descriptor.
+ *)
+
+let default_jobs () = Domain.recommended_domain_count ()
+
+let spawn_with init jobs worker =
+  let jobs = max 1 jobs in
+  let domains =
+    List.init (jobs - 1) (fun _ -> Domain.spawn (fun () -> worker (init ())))
+  in
+  let result = try Ok (worker (init ())) with e -> Error e in
+  List.iter Domain.join domains;
+  match result with Ok () -> () | Error e -> raise e
+
+(*
+ * Run worker on up to jobs domains (including the calling domain) and wait
+ * for all of them to finish.
+ *)
+let spawn jobs worker = spawn_with Ioctls.open_handle jobs worker
+
+let map_with spawn jobs f items =
+  let n = Array.length items in
+  if n = 0 then [||]
+  else
+    let results = Array.make n None in
+    let next = Atomic.make 0 in
+    let worker handle =
+      let rec loop () =
+        let i = Atomic.fetch_and_add next 1 in
+        if i < n then (
+          results.(i) <- Some (f handle items.(i));
+          loop ())
+      in
+      loop ()
+    in
+    spawn (min jobs n) worker;
+    Array.map Option.get results
+
+(* Map f over items using up to jobs domains, preserving order. *)
+let map jobs f items = map_with spawn jobs f items
+
+(* Like map, for work that issues no ioctls and needs no handles. *)
+let map_local jobs f items =
+  map_with (spawn_with Fun.id) jobs (fun () item -> f item) items
+
+let iter jobs f items = ignore @@ map jobs f items
+
+(*
+ * A pool of long-lived domains, each with its own handle, for callers that
+ * issue many small batches where spawning domains per batch would dominate.
+ *)
+type pool = {
+  tasks : (Ioctls.handle -> unit) Queue.t;
+  lock : Mutex.t;
+  nonempty : Condition.t;
+  mutable closing : bool;
+  mutable domains : unit Domain.t list;
+}
+
+let create_pool jobs =
+  let pool =
+    {
+      tasks = Queue.create ();
+      lock = Mutex.create ();
+      nonempty = Condition.create ();
+      closing = false;
+      domains = [];
+    }
+  in
+  let worker () =
+    let handle = Ioctls.open_handle () in
+    let rec loop () =
+      Mutex.lock pool.lock;
+      while Queue.is_empty pool.tasks && not pool.closing do
+        Condition.wait pool.nonempty pool.lock
+      done;
+      match Queue.take_opt pool.tasks with
+      | Some task ->
+          Mutex.unlock pool.lock;
+          task handle;
+          loop ()
+      | None -> Mutex.unlock pool.lock
+    in
+    loop ()
+  in
+  pool.domains <- List.init (max 1 jobs) (fun _ -> Domain.spawn worker);
+  pool
+
+(* Finish the queued tasks and stop the domains. *)
+let close_pool pool =
+  Mutex.lock pool.lock;
+  pool.closing <- true;
+  Condition.broadcast pool.nonempty;
+  Mutex.unlock pool.lock;
+  List.iter Domain.join pool.domains;
+  pool.domains <- []
+
+(* Map f over items on the pool's domains, preserving order. *)
+let pool_map pool f items =
+  let n = Array.length items in
+  let results = Array.make n None in
+  let remaining = ref n in
+  let lock = Mutex.create () in
+  let finished = Condition.create () in
+  let task i handle =
+    let result = try Ok (f handle items.(i)) with e -> Error e in
+    Mutex.lock lock;
+    results.(i) <- Some result;
+    decr remaining;
+    if !remaining = 0 then Condition.signal finished;
+    Mutex.unlock lock
+  in
+  Mutex.lock pool.lock;
+  for i = 0 to n - 1 do
+    Queue.add (task i) pool.tasks
+  done;
+  Condition.broadcast pool.nonempty;
+  Mutex.unlock pool.lock;
+  Mutex.lock lock;
+  while !remaining > 0 do
+    Condition.wait finished lock
+  done;
+  Mutex.unlock lock;
+  Array.map
+    (function
+      | Some (Ok result) -> result
+      | Some (Error e) -> raise e
+      | None -> assert false)
+    results
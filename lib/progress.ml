@@ -0,0 +1,105 @@
+(*
+ * Progress of in-flight sends, sampled with send_progress by a single
+ * background domain no matter how many sends are registered.  The set of
+ * streams and the latest sample of each stream are published through
+ * Atomics, so readers never block the sampler or the senders.
+ *)
+
+type sample = {
+  bytes : int64; (* bytes written to the stream so far *)
+  blocks : int64; (* blocks traversed so far *)
+  throughput : float; (* EWMA of bytes per second *)
+  eta : float option; (* seconds remaining, when the total is known *)
+  time : float; (* Unix.gettimeofday () when sampled *)
+}
+
+type stream = {
+  snapname : string;
+  fd : Unix.file_descr; (* the fd the send is writing to, in this process *)
+  total : int64; (* estimated stream size, 0 if unknown *)
+  sample : sample Atomic.t;
+}
+
+type t = {
+  streams : stream list Atomic.t;
+  interval : float;
+  alpha : float;
+  stopping : bool Atomic.t;
+  mutable sampler : unit Domain.t option;
+}
+
+(*
+ * Sample every interval seconds.  alpha is the weight of the newest rate in
+ * the throughput average, between 0 and 1.
+ *)
+let create interval alpha =
+  {
+    streams = Atomic.make [];
+    interval;
+    alpha;
+    stopping = Atomic.make false;
+    sampler = None;
+  }
+
+let rec update atomic f =
+  let old = Atomic.get atomic in
+  if not (Atomic.compare_and_set atomic old (f old)) then update atomic f
+
+let register t snapname fd total =
+  let sample =
+    { bytes = 0L; blocks = 0L; throughput = 0.; eta = None; time = 0. }
+  in
+  let stream = { snapname; fd; total; sample = Atomic.make sample } in
+  update t.streams (List.cons stream);
+  stream
+
+let unregister t stream = update t.streams (List.filter (( != ) stream))
+
+(* The latest sample of every registered stream. *)
+let snapshot t =
+  List.map
+    (fun stream -> (stream.snapname, stream.total, Atomic.get stream.sample))
+    (Atomic.get t.streams)
+
+let sample_stream t handle now stream =
+  match Ioctls.send_progress handle stream.snapname stream.fd with
+  | Ok (bytes, blocks) ->
+      let prev = Atomic.get stream.sample in
+      let throughput =
+        if prev.time = 0. then 0.
+        else
+          let dt = now -. prev.time in
+          let rate = Int64.to_float (Int64.sub bytes prev.bytes) /. dt in
+          if prev.throughput = 0. then rate
+          else (t.alpha *. rate) +. ((1. -. t.alpha) *. prev.throughput)
+      in
+      let eta =
+        if Int64.equal stream.total 0L || throughput <= 0. then None
+        else
+          let remaining = Int64.to_float (Int64.sub stream.total bytes) in
+          Some (Float.max 0. (remaining /. throughput))
+      in
+      Atomic.set stream.sample { bytes; blocks; throughput; eta; time = now }
+  (* The send has not started yet or has already finished. *)
+  | Error _ -> ()
+
+let start t =
+  if Option.is_none t.sampler then (
+    Atomic.set t.stopping false;
+    t.sampler <-
+      Some
+        (Domain.spawn (fun () ->
+             let handle = Ioctls.open_handle () in
+             while not (Atomic.get t.stopping) do
+               let now = Unix.gettimeofday () in
+               List.iter (sample_stream t handle now) (Atomic.get t.streams);
+               Unix.sleepf t.interval
+             done)))
+
+let stop t =
+  match t.sampler with
+  | Some sampler ->
+      Atomic.set t.stopping true;
+      Domain.join sampler;
+      t.sampler <- None
+  | None -> ()
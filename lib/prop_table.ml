@@ -0,0 +1,43 @@
+(*
+ * Attribute tables for the property modules.  Attributes are built once,
+ * into an array indexed by constructor number, together with hash tables
+ * mapping the values of index properties both ways, so lookups neither
+ * allocate nor scan.
+ *)
+
+type 'a entry = {
+  attributes : 'a;
+  indices : (string, int64) Hashtbl.t;
+  strings : (int64, string) Hashtbl.t;
+}
+
+(*
+ * The table for props, every constructor in declaration order.  make gives
+ * the attributes of a property, None if it has none, and index_table the
+ * (string, index) pairs of attributes.
+ *)
+let create props make index_table =
+  Array.map
+    (fun prop ->
+      Option.map
+        (fun attributes ->
+          let pairs = index_table attributes in
+          let n = Array.length pairs in
+          let indices = Hashtbl.create n and strings = Hashtbl.create n in
+          (* The first entry wins, as with a linear search. *)
+          Array.iter
+            (fun (s, i) ->
+              if not (Hashtbl.mem indices s) then Hashtbl.add indices s i;
+              if not (Hashtbl.mem strings i) then Hashtbl.add strings i s)
+            pairs;
+          { attributes; indices; strings })
+        (make prop))
+    props
+
+let find table i =
+  match table.(i) with
+  | Some entry -> entry
+  | None -> failwith "not a valid property"
+
+let string_to_index entry str = Hashtbl.find_opt entry.indices str
+let index_to_string entry idx = Hashtbl.find_opt entry.strings idx
@@ -0,0 +1,358 @@
+open Error
+
+(*
+ * Replicate a tree of datasets (the `zfs send -R` use case) as a set of
+ * per-dataset chains of snapshot transfers.  Chains of different datasets
+ * run concurrently, but a dataset is not started before its parent has been
+ * replicated, since receiving a child requires the parent to exist.
+ *)
+
+type transfer = {
+  tosnap : string;
+  fromsnap : string option;
+  target : string;
+  resume_token : string option;
+  estimate : int64;
+}
+
+type dataset_plan = {
+  source : string;
+  destination : string;
+  parent : string option;
+  base : Zfs.incremental_base option; (* None for a full send *)
+  transfers : transfer list;
+}
+
+type transfer_result = {
+  transfer : transfer;
+  bytes : int;
+  seconds : float;
+  buffer : Ring.metrics option;
+  error : (zfs_error * string * string) option;
+}
+
+type report = {
+  results : transfer_result list;
+  total_bytes : int;
+  elapsed : float;
+  throughput : float;
+}
+
+let relocate source_root target_root name =
+  let len = String.length source_root in
+  target_root ^ String.sub name len (String.length name - len)
+
+let plan_dataset handle source destination parent =
+  let ( let* ) = Result.bind in
+  let* (source_index : Zfs.guid_index) = Zfs.guid_index handle source in
+  let* token =
+    match Zfs.receive_resume_token handle destination with
+    | Ok token -> Ok token
+    | Error (EzfsNoEnt, _, _) -> Ok None
+    | Error e -> Error e
+  in
+  let* target_index = Zfs.guid_index_opt handle destination in
+  let transfer (fromsnap, tosnap) =
+    {
+      tosnap;
+      fromsnap;
+      target = relocate source destination tosnap;
+      resume_token = None;
+      estimate = 0L;
+    }
+  in
+  let* base, transfers =
+    match token with
+    | Some token -> (
+        let what = Printf.sprintf "cannot resume '%s'" destination in
+        match Resume_token.decode token with
+        | Ok resume -> (
+            match
+              Hashtbl.find_opt source_index.snapshot_guids
+                resume.Resume_token.toguid
+            with
+            | Some i ->
+                let tosnap = fst source_index.snapshots.(i) in
+                let base =
+                  Option.bind resume.fromguid (Zfs.base_of_guid source_index)
+                in
+                let fromsnap = Option.map Zfs.incremental_base_name base in
+                let resumed =
+                  let transfer = transfer (fromsnap, tosnap) in
+                  { transfer with resume_token = Some token }
+                in
+                let nsnaps = Array.length source_index.snapshots in
+                let rest =
+                  List.init (nsnaps - 1 - i) (fun k ->
+                      transfer
+                        ( Some (fst source_index.snapshots.(i + k)),
+                          fst source_index.snapshots.(i + k + 1) ))
+                in
+                Ok (base, resumed :: rest)
+            | None ->
+                let why = "snapshot being received no longer exists" in
+                Error (EzfsNoEnt, what, why))
+        | Error why -> Error (EzfsFault, what, why))
+    | None ->
+        let plan = Zfs.plan_incremental source_index target_index in
+        Ok (plan.base, List.map transfer plan.chain)
+  in
+  let guids = Hashtbl.create (Array.length source_index.snapshots) in
+  Array.iter
+    (fun (name, stats) -> Hashtbl.replace guids name stats.Types.guid)
+    source_index.snapshots;
+  Hashtbl.iter
+    (fun guid (name, _txg) -> Hashtbl.replace guids name guid)
+    source_index.bookmark_guids;
+  let with_guid name =
+    Option.map (fun guid -> (name, guid)) (Hashtbl.find_opt guids name)
+  in
+  (* Resumed transfers are not estimated, the token knows how far it got. *)
+  let pairs =
+    List.filter_map
+      (fun transfer ->
+        match (transfer.resume_token, transfer.fromsnap) with
+        | Some _, _ -> None
+        | None, Some fromsnap ->
+            Option.bind (with_guid fromsnap) (fun from ->
+                Option.map
+                  (fun to_ -> (Some from, to_))
+                  (with_guid transfer.tosnap))
+        | None, None ->
+            Option.map (fun to_ -> (None, to_)) (with_guid transfer.tosnap))
+      transfers
+  in
+  Ok ({ source; destination; parent; base; transfers }, pairs)
+
+(*
+ * Plans are returned parents first.  Estimates are looked up in (and added
+ * to) cache, so repeated planning only estimates new snapshots.
+ *)
+let plan jobs cache flags source_root target_root =
+  let ( let* ) = Result.bind in
+  let handle = Ioctls.open_handle () in
+  let rec walk name parent acc =
+    let* children = Zfs.list_children handle name in
+    List.fold_left
+      (fun acc (child, _stats) ->
+        let* acc = acc in
+        walk child (Some name) acc)
+      (Ok ((name, parent) :: acc))
+      children
+  in
+  let* datasets = walk source_root None [] in
+  let* plans =
+    Parallel.map jobs
+      (fun handle (source, parent) ->
+        let destination = relocate source_root target_root source in
+        plan_dataset handle source destination parent)
+      (Array.of_list @@ List.rev datasets)
+    |> Array.fold_left
+         (fun acc planned ->
+           let* acc = acc in
+           let* planned = planned in
+           Ok (planned :: acc))
+         (Ok [])
+    |> Result.map List.rev
+  in
+  let pairs = List.concat_map snd plans in
+  let plans = List.map fst plans in
+  let estimates =
+    Send_estimate.estimate_many jobs cache flags (Array.of_list pairs)
+  in
+  let sizes = Hashtbl.create (Array.length estimates) in
+  let* () =
+    Array.fold_left
+      (fun acc (estimate : Send_estimate.estimate) ->
+        let* () = acc in
+        let* space = estimate.space in
+        Hashtbl.replace sizes (estimate.fromsnap, estimate.tosnap) space;
+        Ok ())
+      (Ok ()) estimates
+  in
+  let estimated transfer =
+    match Hashtbl.find_opt sizes (transfer.fromsnap, transfer.tosnap) with
+    | Some estimate -> { transfer with estimate }
+    | None -> transfer
+  in
+  Ok
+    (List.map
+       (fun plan -> { plan with transfers = List.map estimated plan.transfers })
+       plans)
+
+let relay_buflen = 1 lsl 20
+
+(* Copy src to dst until EOF or until either side of the pipeline fails. *)
+let relay throttleopt src dst =
+  let buf = Bytes.create relay_buflen in
+  let total = ref 0 in
+  let rec loop () =
+    match Unix.read src buf 0 relay_buflen with
+    | 0 -> ()
+    | n ->
+        Option.iter (fun throttle -> Throttle.consume throttle n) throttleopt;
+        ignore @@ Unix.write dst buf 0 n;
+        total := !total + n;
+        loop ()
+    | exception Unix.Unix_error (Unix.EINTR, _, _) -> loop ()
+  in
+  (try loop () with Unix.Unix_error (_, _, _) -> ());
+  !total
+
+let execute handle throttleopt ringopt progressopt flags force transfer =
+  let start = Unix.gettimeofday () in
+  let send_r, send_w = Unix.pipe ~cloexec:true () in
+  let recv_r, recv_w = Unix.pipe ~cloexec:true () in
+  let sender =
+    Domain.spawn (fun () ->
+        let handle = Ioctls.open_handle () in
+        let streamopt =
+          Option.map
+            (fun progress ->
+              Progress.register progress transfer.tosnap send_w
+                transfer.estimate)
+            progressopt
+        in
+        let result =
+          match transfer.resume_token with
+          | Some token -> Zfs.send_resume handle token send_w
+          | None ->
+              Zfs.send handle transfer.tosnap transfer.fromsnap send_w flags
+        in
+        Option.iter
+          (fun progress -> Option.iter (Progress.unregister progress) streamopt)
+          progressopt;
+        Unix.close send_w;
+        result)
+  in
+  let receiver =
+    Domain.spawn (fun () ->
+        let result =
+          Zfs.receive handle transfer.target None recv_r force true
+        in
+        Unix.close recv_r;
+        result)
+  in
+  let bytes, buffer =
+    match ringopt with
+    | Some ring ->
+        Ring.reset ring;
+        ignore @@ Ring.copy ring send_r recv_w;
+        let metrics = Ring.metrics ring in
+        (metrics.Ring.bytes_out, Some metrics)
+    | None -> (relay throttleopt send_r recv_w, None)
+  in
+  Unix.close send_r;
+  Unix.close recv_w;
+  let sent = Domain.join sender in
+  let received = Domain.join receiver in
+  let error =
+    match (sent, received) with
+    | Ok (), Ok _ -> None
+    (* A failed receive shows up on the sending side as a broken pipe. *)
+    | Error (EzfsIo, _, _), Error e -> Some e
+    | Error e, _ -> Some e
+    | Ok (), Error e -> Some e
+  in
+  let seconds = Unix.gettimeofday () -. start in
+  { transfer; bytes; seconds; buffer; error }
+
+let skipped transfer why =
+  let what = Printf.sprintf "cannot receive '%s'" transfer.target in
+  let error = Some (EzfsNoEnt, what, why) in
+  { transfer; bytes = 0; seconds = 0.; buffer = None; error }
+
+(*
+ * Run the plans with at most jobs datasets in flight and an optional global
+ * bandwidth limit in bytes per second.  Streams go through a ring buffer
+ * of bufferopt bytes when given, and sends are registered with the optional
+ * progress monitor while they run.  Each stream in flight uses two
+ * more domains for its send and receive ioctls, and a third to fill the
+ * ring buffer if there is one, so jobs should stay well below the
+ * runtime's domain limit.  Every worker allocates its ring once and reuses
+ * it for all of its streams.  The application should ignore SIGPIPE,
+ * so that a failed receive is reported as an error instead of terminating
+ * the process.
+ *)
+let run jobs bandwidth bufferopt progressopt flags force plans =
+  let throttleopt = Option.map Throttle.create bandwidth in
+  let lock = Mutex.create () in
+  let cond = Condition.create () in
+  let ready = Queue.create () in
+  let running = ref 0 in
+  let results = ref [] in
+  let sources = Hashtbl.create 64 in
+  let children = Hashtbl.create 64 in
+  List.iter (fun plan -> Hashtbl.replace sources plan.source ()) plans;
+  List.iter
+    (fun plan ->
+      match plan.parent with
+      | Some parent when Hashtbl.mem sources parent ->
+          Hashtbl.add children parent plan
+      | _ -> Queue.add plan ready)
+    plans;
+  let rec skip plan =
+    let why = "parent dataset was not replicated" in
+    List.iter
+      (fun transfer -> results := skipped transfer why :: !results)
+      plan.transfers;
+    List.iter skip (Hashtbl.find_all children plan.source)
+  in
+  let create_ring size =
+    Ring.create size (min size Ring.chunk_size) (size / 2) throttleopt
+  in
+  let replicate_dataset handle ringopt plan =
+    let rec loop acc = function
+      | [] -> (true, acc)
+      | transfer :: rest ->
+          let result =
+            execute handle throttleopt ringopt progressopt flags force
+              transfer
+          in
+          if Option.is_none result.error then loop (result :: acc) rest
+          else
+            let why = "an earlier transfer of this dataset failed" in
+            let acc = result :: acc in
+            let acc =
+              List.fold_left (fun acc t -> skipped t why :: acc) acc rest
+            in
+            (false, acc)
+    in
+    loop [] plan.transfers
+  in
+  let worker handle =
+    let ringopt = Option.map create_ring bufferopt in
+    let rec loop () =
+      Mutex.lock lock;
+      while Queue.is_empty ready && !running > 0 do
+        Condition.wait cond lock
+      done;
+      if Queue.is_empty ready then (
+        Condition.broadcast cond;
+        Mutex.unlock lock)
+      else
+        let plan = Queue.pop ready in
+        incr running;
+        Mutex.unlock lock;
+        let ok, dataset_results = replicate_dataset handle ringopt plan in
+        Mutex.lock lock;
+        decr running;
+        results := List.rev_append (List.rev dataset_results) !results;
+        let kids = Hashtbl.find_all children plan.source in
+        if ok then List.iter (fun kid -> Queue.add kid ready) kids
+        else List.iter skip kids;
+        Condition.broadcast cond;
+        Mutex.unlock lock;
+        loop ()
+    in
+    loop ()
+  in
+  let start = Unix.gettimeofday () in
+  Parallel.spawn jobs worker;
+  let elapsed = Unix.gettimeofday () -. start in
+  let results = List.rev !results in
+  let total_bytes = List.fold_left (fun acc r -> acc + r.bytes) 0 results in
+  let throughput =
+    if elapsed > 0. then Float.of_int total_bytes /. elapsed else 0.
+  in
+  { results; total_bytes; elapsed; throughput }
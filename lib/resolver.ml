@@ -0,0 +1,141 @@
+open Error
+
+(*
+ * Batched resolution of (dataset, object) pairs to paths and stats.  A
+ * batch is deduplicated, pairs found in the cache are answered from it,
+ * and the rest are resolved with obj_to_stats on a pool of domains.
+ *
+ * Each snapshot has its own bounded cache mapping an object to its
+ * generation, path and stats.  A request may carry the generation it
+ * expects, in which case a cached entry for another incarnation of the
+ * object number is not used.  Objects of a live filesystem can be renamed,
+ * freed or reused at any time, so they are never cached and always
+ * resolved again.  A snapshot destroyed and created again under the same
+ * name must be invalidated.
+ *)
+
+type request = { dataset : string; obj : int64; gen : int64 option }
+
+type t = {
+  pool : Parallel.pool;
+  capacity : int; (* entries per dataset *)
+  caches : (string, (int64, (string * Types.stat) option) Lru.t) Hashtbl.t;
+  lock : Mutex.t;
+  requests : int Atomic.t;
+  unique : int Atomic.t;
+}
+
+let create jobs capacity =
+  {
+    pool = Parallel.create_pool jobs;
+    capacity;
+    caches = Hashtbl.create 16;
+    lock = Mutex.create ();
+    requests = Atomic.make 0;
+    unique = Atomic.make 0;
+  }
+
+let close t = Parallel.close_pool t.pool
+
+let dataset_cache t dataset =
+  Mutex.lock t.lock;
+  let cache =
+    match Hashtbl.find_opt t.caches dataset with
+    | Some cache -> cache
+    | None ->
+        let cache = Lru.create t.capacity in
+        Hashtbl.replace t.caches dataset cache;
+        cache
+  in
+  Mutex.unlock t.lock;
+  cache
+
+(* Only snapshots are immutable, so only their resolutions are cached. *)
+let cacheable dataset = String.contains dataset '@'
+
+(* Forget what is cached for dataset, e.g. after it was recreated. *)
+let invalidate t dataset =
+  Mutex.lock t.lock;
+  Hashtbl.remove t.caches dataset;
+  Mutex.unlock t.lock
+
+let cached t request =
+  if not (cacheable request.dataset) then None
+  else
+    match Lru.find_opt (dataset_cache t request.dataset) request.obj with
+    | Some (Some (_, stat)) as found -> (
+        match request.gen with
+        | Some gen when not (Int64.equal gen stat.Types.gen) -> None
+        | _ -> found)
+    | found -> found
+
+let resolve_one t handle (dataset, obj) =
+  let add resolved =
+    if cacheable dataset then Lru.add (dataset_cache t dataset) obj resolved
+  in
+  match Ioctls.obj_to_stats handle dataset obj with
+  | Ok resolved ->
+      add (Some resolved);
+      Ok (Some resolved)
+  (* Freed, on the delete queue, or not a ZPL object. *)
+  | Error (Unix.ENOENT | Unix.ESTALE | Unix.EOPNOTSUPP) ->
+      add None;
+      Ok None
+  | Error errno ->
+      let e, why = zfs_standard_error errno in
+      let what =
+        Printf.sprintf "cannot resolve object %Ld in '%s'" obj dataset
+      in
+      Error (e, what, why)
+
+(*
+ * Resolve each request to Some (path, stats), or None if the object does
+ * not exist.  Results are in the same order as requests.
+ *)
+let resolve_batch t requests =
+  ignore @@ Atomic.fetch_and_add t.requests (Array.length requests);
+  let results = Array.make (Array.length requests) (Ok None) in
+  let pending = Hashtbl.create (Array.length requests) in
+  Array.iteri
+    (fun i request ->
+      match cached t request with
+      | Some resolved -> results.(i) <- Ok resolved
+      | None ->
+          let key = (request.dataset, request.obj) in
+          let waiting = Hashtbl.find_opt pending key in
+          Hashtbl.replace pending key (i :: Option.value ~default:[] waiting))
+    requests;
+  let keys = Array.of_seq (Hashtbl.to_seq_keys pending) in
+  ignore @@ Atomic.fetch_and_add t.unique (Array.length keys);
+  let resolved = Parallel.pool_map t.pool (resolve_one t) keys in
+  Array.iteri
+    (fun k key ->
+      let waiting = Hashtbl.find pending key in
+      List.iter (fun i -> results.(i) <- resolved.(k)) waiting)
+    keys;
+  results
+
+(* Single resolutions are batches of one. *)
+let resolve t dataset obj =
+  (resolve_batch t [| { dataset; obj; gen = None } |]).(0)
+
+(*
+ * Requests seen, distinct pairs sent to the kernel after deduplication and
+ * caching, and the hit ratio of the caches.
+ *)
+let stats t =
+  Mutex.lock t.lock;
+  let caches = Hashtbl.fold (fun _ cache acc -> cache :: acc) t.caches [] in
+  Mutex.unlock t.lock;
+  let hits, misses =
+    List.fold_left
+      (fun (hits, misses) cache ->
+        let _, h, m = Lru.stats cache in
+        (hits + h, misses + m))
+      (0, 0) caches
+  in
+  let lookups = hits + misses in
+  let ratio =
+    if lookups = 0 then 0. else Float.of_int hits /. Float.of_int lookups
+  in
+  (Atomic.get t.requests, Atomic.get t.unique, ratio)
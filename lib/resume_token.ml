@@ -0,0 +1,117 @@
+(*
+ * A receive_resume_token is "<version>-<checksum>-<packed_len>-<payload>",
+ * where the payload is the hex encoding of a zlib compressed packed nvlist
+ * and the checksum is the first word of its fletcher4 checksum.
+ *)
+
+let version = 1
+
+type t = {
+  fromguid : int64 option;
+  toguid : int64;
+  toname : string;
+  obj : int64;
+  offset : int64;
+  bytes : int64;
+  flags : Types.lzc_send_flag array;
+}
+
+(*
+ * Only the first word of the fletcher4 checksum is recorded in the token.
+ * The kernel sums native order words, as does the check in libzfs.
+ *)
+let fletcher4_word0 buf =
+  let nwords = Bytes.length buf / 4 in
+  let rec loop i a =
+    if i >= nwords then a
+    else
+      let word = Bytes.get_int32_ne buf (i * 4) in
+      let word = Int64.logand (Int64.of_int32 word) 0xffffffffL in
+      loop (i + 1) (Int64.add a word)
+  in
+  loop 0 0L
+
+let bytes_of_hex hex =
+  let len = String.length hex / 2 in
+  let buf = Bytes.create len in
+  let rec loop i =
+    if i >= len then Some buf
+    else
+      match int_of_string_opt ("0x" ^ String.sub hex (i * 2) 2) with
+      | Some byte ->
+          Bytes.set_uint8 buf i byte;
+          loop (i + 1)
+      | None -> None
+  in
+  if String.length hex mod 2 != 0 then None else loop 0
+
+let decode token =
+  let open Nvpair in
+  let ( let* ) = Result.bind in
+  let invalid = Error "resume token is corrupt (invalid format)" in
+  let* token_version, checksum, packed_len, payload =
+    match String.split_on_char '-' token with
+    | [ v; c; l; p ] -> (
+        match
+          ( int_of_string_opt v,
+            Int64.of_string_opt ("0x" ^ c),
+            int_of_string_opt ("0x" ^ l) )
+        with
+        | Some v, Some c, Some l -> Ok (v, c, l, p)
+        | _ -> invalid)
+    | _ -> invalid
+  in
+  let* () =
+    if token_version != version then
+      Error
+        (Printf.sprintf "resume token is corrupt (invalid version %d)"
+           token_version)
+    else Ok ()
+  in
+  let* compressed =
+    Option.to_result
+      ~none:"resume token is corrupt (payload is not hex-encoded)"
+      (bytes_of_hex payload)
+  in
+  let* () =
+    if not (Int64.equal (fletcher4_word0 compressed) checksum) then
+      Error "resume token is corrupt (incorrect checksum)"
+    else Ok ()
+  in
+  let* packed =
+    Option.to_result ~none:"resume token is corrupt (decompression failed)"
+      (Util.uncompress compressed packed_len)
+  in
+  let* nvl =
+    try Ok (Nvlist.unpack packed)
+    with _ -> Error "resume token is corrupt (nvlist_unpack failed)"
+  in
+  match
+    ( Nvlist.lookup_uint64 nvl "toguid",
+      Nvlist.lookup_string nvl "toname",
+      Nvlist.lookup_uint64 nvl "object",
+      Nvlist.lookup_uint64 nvl "offset" )
+  with
+  | Some toguid, Some toname, Some obj, Some offset ->
+      let flags =
+        [
+          ("embedok", Types.LzcSendFlagEmbedData);
+          ("largeblockok", Types.LzcSendFlagLargeBlock);
+          ("compressok", Types.LzcSendFlagCompress);
+          ("rawok", Types.LzcSendFlagRaw);
+        ]
+        |> List.filter_map (fun (name, flag) ->
+               if Nvlist.exists nvl name then Some flag else None)
+        |> Array.of_list
+      in
+      Ok
+        {
+          fromguid = Nvlist.lookup_uint64 nvl "fromguid";
+          toguid;
+          toname;
+          obj;
+          offset;
+          bytes = Nvlist.lookup_uint64 nvl "bytes" |> Option.value ~default:0L;
+          flags;
+        }
+  | _ -> Error "resume token is corrupt (missing required fields)"
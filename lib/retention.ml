@@ -0,0 +1,272 @@
+open Error
+
+(*
+ * Planning which snapshots of a filesystem to destroy to free a target
+ * amount of space.  The cost of a plan is the number of snapshots it
+ * destroys, and the planner looks for the cheapest plan that frees the
+ * target without touching snapshots protected by the rules.
+ *
+ * A block is referenced by a contiguous range of snapshots, so it is freed
+ * only if a single run of destroyed snapshots covers that range.  Space
+ * freed by a plan is therefore the sum of the space freed by its maximal
+ * runs, whether they are split by protected snapshots or by snapshots the
+ * plan keeps, and the planner finds the cheapest set of runs by dynamic
+ * programming over the snapshots, trying costs in increasing order.
+ *
+ * The space freed by a range is only known from a space_snaps ioctl, so
+ * ranges are bounded before they are queried.  Every block freed by
+ * destroying snapshots i..j was written in the interval before one of
+ * them and is still referenced by it, so the sum of their written values
+ * (space_written from the previous snapshot) bounds the range from above.
+ * A range is only queried when that bound could improve the plan being
+ * built, and a single snapshot frees its used space without a query.
+ * Answers are memoized, and with the ioctl budget spent the largest known
+ * sub-range stands in as a lower bound.
+ *
+ * Space freed by a range depends only on the range and its neighbours, so
+ * the cache is keyed by the neighbours' guids and survives destroying
+ * snapshots elsewhere.  Ranges ending at the newest snapshot depend on the
+ * live filesystem and are never cached.
+ *)
+
+type snapshot = {
+  name : string;
+  guid : int64;
+  creation : int64; (* seconds since the epoch *)
+  written : int64 option; (* since the previous snapshot *)
+  used : int64 option; (* freed by destroying it alone *)
+}
+
+type rules = {
+  keep_newest : int;
+  min_age : int64; (* seconds, younger snapshots are kept *)
+  keep : string -> bool;
+}
+
+type cache = {
+  ranges : (int64 * string * string * int64, int64) Hashtbl.t;
+  lock : Mutex.t;
+}
+
+type plan = {
+  destroy : string list; (* oldest first *)
+  freed : int64;
+  exact : bool; (* false if freed is a lower bound, the budget ran out *)
+  met : bool; (* whether freed reaches the target *)
+  queries : int; (* space_snaps ioctls issued *)
+}
+
+let create_cache () = { ranges = Hashtbl.create 256; lock = Mutex.create () }
+
+let inner = function Ok x -> Ok x | Error (e, _what, why) -> Error (e, why)
+
+(* Snapshots of fsname, oldest first. *)
+let snapshots handle fsname =
+  let snapshot (name, stats, props) =
+    {
+      name;
+      guid = stats.Types.guid;
+      creation = Option.value ~default:0L (Zfs.uint64_prop props "creation");
+      written = Zfs.uint64_prop props "written";
+      used = Zfs.uint64_prop props "used";
+    }
+  in
+  inner (Zfs.list_snapshots_props handle fsname)
+  |> Result.map (fun snapshots -> Array.of_list (List.map snapshot snapshots))
+
+let space_snaps handle firstsnap lastsnap =
+  inner (Zfs.snaprange_space handle firstsnap lastsnap)
+
+let written handle snaps i =
+  match snaps.(i).written with
+  | Some written -> Ok written
+  | None when i = 0 -> Ok Int64.max_int
+  | None -> (
+      match Ioctls.space_written handle snaps.(i).name snaps.(i - 1).name with
+      | Ok (written, _, _) -> Ok written
+      | Error errno -> Error (zfs_standard_error errno))
+
+let saturating_add a b =
+  let sum = Int64.add a b in
+  if Int64.compare sum a < 0 then Int64.max_int else sum
+
+let better a b =
+  match (a, b) with
+  | Some (used, _, _), Some (used', _, _) ->
+      if Int64.unsigned_compare used' used > 0 then b else a
+  | None, _ -> b
+  | _, None -> a
+
+(*
+ * The cheapest set of the n snapshots to destroy to free target, as
+ * maximal runs (first, last) oldest first, with the space they free and
+ * whether that is exact.  deletable i says whether snapshot i may be
+ * destroyed, upper i j bounds the space freed by destroying i..j from
+ * above, and freed i j gives it as Ok (used, exact).  If the target
+ * cannot be met every deletable snapshot is destroyed.
+ *
+ * Space freed by a set of snapshots is the sum over its maximal runs, so
+ * plans are built over prefixes of the snapshots for each cost in turn:
+ * kept.(c).(p) is the best plan of cost c for the snapshots before p that
+ * keeps snapshot p - 1, and ended.(c).(p) the best whose last run ends
+ * at p - 1.  A run is only asked for when its upper bound could improve
+ * on the best plan found so far.
+ *)
+let search n deletable upper freed target =
+  let ( let* ) = Result.bind in
+  (* runnable.(p): deletable snapshots in a row ending at p - 1 *)
+  let runnable = Array.make (n + 1) 0 in
+  for p = 1 to n do
+    runnable.(p) <- (if deletable (p - 1) then runnable.(p - 1) + 1 else 0)
+  done;
+  let total =
+    Array.fold_left (fun acc r -> if r > 0 then acc + 1 else acc) 0 runnable
+  in
+  let kept = Array.make (total + 1) [||] in
+  let ended = Array.make (total + 1) [||] in
+  let promising bound best =
+    match best with
+    | Some (used, _, _) -> Int64.unsigned_compare bound used > 0
+    | None -> true
+  in
+  (* The best plan whose last run ends at p - 1 and has length k or more. *)
+  let rec ending c p k best =
+    if k > min c runnable.(p) then Ok best
+    else
+      let first = p - k and last = p - 1 in
+      match kept.(c - k).(first) with
+      | Some (used, exact, runs)
+        when promising (saturating_add used (upper first last)) best ->
+          let* used', exact' = freed first last in
+          let plan =
+            (saturating_add used used', exact && exact', (first, last) :: runs)
+          in
+          ending c p (k + 1) (better best (Some plan))
+      | _ -> ending c p (k + 1) best
+  in
+  let fill c =
+    kept.(c) <- Array.make (n + 1) None;
+    ended.(c) <- Array.make (n + 1) None;
+    if c = 0 then kept.(c).(0) <- Some (0L, true, []);
+    let rec at p =
+      if p > n then Ok ()
+      else
+        let* plan = ending c p 1 None in
+        ended.(c).(p) <- plan;
+        kept.(c).(p) <- better kept.(c).(p - 1) ended.(c).(p - 1);
+        at (p + 1)
+    in
+    at 1
+  in
+  let rec extend c =
+    let* () = fill c in
+    match better kept.(c).(n) ended.(c).(n) with
+    | Some (used, exact, runs)
+      when Int64.unsigned_compare used target >= 0 || c = total ->
+        Ok (List.rev runs, used, exact)
+    | _ when c = total -> Ok ([], 0L, true)
+    | _ -> extend (c + 1)
+  in
+  extend 0
+
+(*
+ * The cheapest set of snapshots of fsname to destroy to free target bytes
+ * under rules, issuing at most budget space_snaps ioctls.  If the target
+ * cannot be met, the plan destroys everything the rules allow.
+ *)
+let plan handle cache rules fsname target budget =
+  let ( let* ) = Result.bind in
+  match
+    let* snaps = snapshots handle fsname in
+    let n = Array.length snaps in
+    let now = Int64.of_float (Unix.time ()) in
+    let deletable i =
+      i < n - rules.keep_newest
+      && (not (rules.keep snaps.(i).name))
+      && Int64.compare (Int64.sub now snaps.(i).creation) rules.min_age >= 0
+    in
+    let* written =
+      Array.fold_left
+        (fun acc i ->
+          let* acc = acc in
+          let* w = written handle snaps i in
+          Ok (w :: acc))
+        (Ok [])
+        (Array.init n Fun.id)
+      |> Result.map (fun l -> Array.of_list (List.rev l))
+    in
+    (* prefix.(i) is the sum of written before snapshot i, saturated *)
+    let prefix = Array.make (n + 1) 0L in
+    Array.iteri
+      (fun i w -> prefix.(i + 1) <- saturating_add prefix.(i) w)
+      written;
+    let upper i j =
+      if Int64.equal prefix.(j + 1) Int64.max_int then Int64.max_int
+      else Int64.sub prefix.(j + 1) prefix.(i)
+    in
+    let memo = Hashtbl.create 64 in
+    let queries = ref 0 in
+    let cache_key i j =
+      if j = n - 1 then None
+      else
+        let prev = if i = 0 then 0L else snaps.(i - 1).guid in
+        Some (prev, snaps.(i).name, snaps.(j).name, snaps.(j + 1).guid)
+    in
+    let lookup_cache key =
+      Mutex.lock cache.lock;
+      let found = Hashtbl.find_opt cache.ranges key in
+      Mutex.unlock cache.lock;
+      found
+    in
+    let store_cache key used =
+      Mutex.lock cache.lock;
+      Hashtbl.replace cache.ranges key used;
+      Mutex.unlock cache.lock
+    in
+    let lower i j =
+      Hashtbl.fold
+        (fun (i', j') used acc ->
+          if i <= i' && j' <= j && Int64.compare used acc > 0 then used
+          else acc)
+        memo 0L
+    in
+    (* Space freed by i..j: Ok (used, exact) *)
+    let freed i j =
+      match Hashtbl.find_opt memo (i, j) with
+      | Some used -> Ok (used, true)
+      | None when i = j && Option.is_some snaps.(i).used ->
+          let used = Option.get snaps.(i).used in
+          Hashtbl.replace memo (i, j) used;
+          Ok (used, true)
+      | None -> (
+          match Option.bind (cache_key i j) lookup_cache with
+          | Some used ->
+              Hashtbl.replace memo (i, j) used;
+              Ok (used, true)
+          | None when !queries < budget ->
+              incr queries;
+              let* used = space_snaps handle snaps.(i).name snaps.(j).name in
+              Hashtbl.replace memo (i, j) used;
+              Option.iter (fun key -> store_cache key used) (cache_key i j);
+              Ok (used, true)
+          | None -> Ok (lower i j, false))
+    in
+    let* runs, freed, exact = search n deletable upper freed target in
+    let destroy =
+      List.concat_map
+        (fun (i, j) -> List.init (j - i + 1) (fun d -> snaps.(i + d).name))
+        runs
+    in
+    Ok
+      {
+        destroy;
+        freed;
+        exact;
+        met = Int64.unsigned_compare freed target >= 0;
+        queries = !queries;
+      }
+  with
+  | Ok plan -> Ok plan
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot plan retention for '%s'" fsname in
+      Error (e, what, why)
@@ -0,0 +1,185 @@
+(*
+ * A large ring buffer between a stream source and a slow or bursty sink,
+ * in the manner of mbuffer.  One domain reads the source into the ring as
+ * fast as it can while the calling domain drains the ring into the sink,
+ * so that a send writing into the source only waits on the sink once the
+ * whole ring is full.
+ *
+ * The sink is only started once the ring has filled to the high watermark
+ * (or the source has ended), and after the ring has filled up completely the
+ * source is only read again once the ring has drained to the low watermark.
+ *)
+
+type metrics = {
+  capacity : int;
+  fill : int; (* bytes currently buffered *)
+  peak_fill : int;
+  bytes_in : int;
+  bytes_out : int;
+  source_stall : float; (* seconds spent waiting for space in the ring *)
+  sink_stall : float; (* seconds spent waiting for data in the ring *)
+}
+
+type t = {
+  buf : Util.buffer;
+  capacity : int;
+  high : int;
+  low : int;
+  throttle : Throttle.t option;
+  lock : Mutex.t;
+  filled : Condition.t;
+  drained : Condition.t;
+  mutable bytes_in : int;
+  mutable bytes_out : int;
+  mutable peak_fill : int;
+  mutable source_stall : float;
+  mutable sink_stall : float;
+  mutable eof : bool; (* the source has ended or failed *)
+  mutable closed : bool; (* the sink has failed *)
+  mutable error : Unix.error option;
+}
+
+let chunk_size = 1 lsl 20
+
+(*
+ * create capacity high low throttle allocates a ring of capacity bytes, with
+ * watermarks in bytes and an optional rate limit on the sink.
+ *)
+let create capacity high low throttle =
+  if capacity <= 0 || high < 0 || high > capacity || low < 0 || low > capacity
+  then invalid_arg "Ring.create";
+  {
+    buf = Util.alloc_buffer capacity;
+    capacity;
+    high;
+    low;
+    throttle;
+    lock = Mutex.create ();
+    filled = Condition.create ();
+    drained = Condition.create ();
+    bytes_in = 0;
+    bytes_out = 0;
+    peak_fill = 0;
+    source_stall = 0.;
+    sink_stall = 0.;
+    eof = false;
+    closed = false;
+    error = None;
+  }
+
+let metrics (t : t) =
+  Mutex.lock t.lock;
+  let (metrics : metrics) =
+    {
+      capacity = t.capacity;
+      fill = t.bytes_in - t.bytes_out;
+      peak_fill = t.peak_fill;
+      bytes_in = t.bytes_in;
+      bytes_out = t.bytes_out;
+      source_stall = t.source_stall;
+      sink_stall = t.sink_stall;
+    }
+  in
+  Mutex.unlock t.lock;
+  metrics
+
+(* Record the first error and wake up the other side.  Called locked. *)
+let fail t e =
+  if Option.is_none t.error then t.error <- Some e;
+  Condition.broadcast t.filled;
+  Condition.broadcast t.drained
+
+let fill_from (t : t) src =
+  let rec loop () =
+    Mutex.lock t.lock;
+    if t.bytes_in - t.bytes_out = t.capacity then (
+      let start = Unix.gettimeofday () in
+      let low = min t.low (t.capacity - 1) in
+      while t.bytes_in - t.bytes_out > low && not t.closed do
+        Condition.wait t.drained t.lock
+      done;
+      t.source_stall <- t.source_stall +. (Unix.gettimeofday () -. start));
+    let closed = t.closed in
+    let fill = t.bytes_in - t.bytes_out in
+    let pos = t.bytes_in mod t.capacity in
+    let len = min chunk_size (min (t.capacity - fill) (t.capacity - pos)) in
+    Mutex.unlock t.lock;
+    if not closed then
+      match Util.read_buffer src t.buf pos len with
+      | 0 ->
+          Mutex.lock t.lock;
+          t.eof <- true;
+          Condition.broadcast t.filled;
+          Mutex.unlock t.lock
+      | n ->
+          Mutex.lock t.lock;
+          t.bytes_in <- t.bytes_in + n;
+          t.peak_fill <- max t.peak_fill (t.bytes_in - t.bytes_out);
+          Condition.broadcast t.filled;
+          Mutex.unlock t.lock;
+          loop ()
+      | exception Unix.Unix_error (Unix.EINTR, _, _) -> loop ()
+      | exception Unix.Unix_error (e, _, _) ->
+          Mutex.lock t.lock;
+          t.eof <- true;
+          fail t e;
+          Mutex.unlock t.lock
+  in
+  loop ()
+
+let drain_to (t : t) dst =
+  let rec loop () =
+    Mutex.lock t.lock;
+    if t.bytes_in - t.bytes_out = 0 && not t.eof then (
+      let start = Unix.gettimeofday () in
+      while t.bytes_in - t.bytes_out < max 1 t.high && not t.eof do
+        Condition.wait t.filled t.lock
+      done;
+      t.sink_stall <- t.sink_stall +. (Unix.gettimeofday () -. start));
+    let fill = t.bytes_in - t.bytes_out in
+    let pos = t.bytes_out mod t.capacity in
+    let len = min chunk_size (min fill (t.capacity - pos)) in
+    Mutex.unlock t.lock;
+    if len > 0 then (
+      Option.iter (fun throttle -> Throttle.consume throttle len) t.throttle;
+      match Util.write_buffer dst t.buf pos len with
+      | n ->
+          Mutex.lock t.lock;
+          t.bytes_out <- t.bytes_out + n;
+          Condition.broadcast t.drained;
+          Mutex.unlock t.lock;
+          loop ()
+      | exception Unix.Unix_error (Unix.EINTR, _, _) -> loop ()
+      | exception Unix.Unix_error (e, _, _) ->
+          Mutex.lock t.lock;
+          t.closed <- true;
+          fail t e;
+          Mutex.unlock t.lock)
+  in
+  loop ()
+
+(*
+ * Clear the state of a previous copy so that the ring, and its memory, can
+ * be used for another.  Must not be called while a copy is running.
+ *)
+let reset (t : t) =
+  Mutex.lock t.lock;
+  t.bytes_in <- 0;
+  t.bytes_out <- 0;
+  t.peak_fill <- 0;
+  t.source_stall <- 0.;
+  t.sink_stall <- 0.;
+  t.eof <- false;
+  t.closed <- false;
+  t.error <- None;
+  Mutex.unlock t.lock
+
+(*
+ * Copy src to dst through the ring until src ends or either side fails.  A
+ * ring must be reset before it is used for another copy.
+ *)
+let copy t src dst =
+  let source = Domain.spawn (fun () -> fill_from t src) in
+  drain_to t dst;
+  Domain.join source;
+  match t.error with Some e -> Error e | None -> Ok t.bytes_out
@@ -0,0 +1,118 @@
+open Nvpair
+
+(*
+ * Auditing scan of the holds and bookmarks in a dataset tree.  Datasets
+ * are listed from the calling domain, and a chunk of them at a time is
+ * handed to a pool of domains that list their snapshots and bookmarks.
+ * Then get_holds runs for every snapshot of the chunk, again on the pool.
+ * Results are passed to the callback as each chunk completes, so memory
+ * stays bounded however large the tree is.
+ *)
+
+type request = {
+  holds : bool;
+  bookmarks : bool;
+  bookmark_props : string array option; (* None for all of them *)
+}
+
+type hold = { snapname : string; tag : string; time : int64 }
+
+type bookmark = {
+  bookmark : string; (* fs#name *)
+  guid : int64 option;
+  createtxg : int64 option;
+  creation : int64 option;
+  props : Nvlist.t; (* as returned by get_bookmarks *)
+}
+
+type finding =
+  | Hold of hold
+  | Bookmark of bookmark
+  | Failed of Error.zfs_error * string * string
+
+let chunk_size = 64
+
+let bookmarks handle request fsname =
+  match Zfs.get_bookmarks handle fsname request.bookmark_props with
+  | Ok nvl ->
+      let rec collect prev acc =
+        match Nvlist.next_nvpair nvl prev with
+        | Some pair ->
+            let name = Nvpair.name pair in
+            let props =
+              Option.value ~default:(Nvlist.alloc ())
+                (Nvlist.lookup_nvlist nvl name)
+            in
+            let bookmark =
+              {
+                bookmark = fsname ^ "#" ^ name;
+                guid = Zfs.uint64_prop props "guid";
+                createtxg = Zfs.uint64_prop props "createtxg";
+                creation = Zfs.uint64_prop props "creation";
+                props;
+              }
+            in
+            collect (Some pair) (Bookmark bookmark :: acc)
+        | None -> List.rev acc
+      in
+      collect None []
+  | Error (e, what, why) -> [ Failed (e, what, why) ]
+
+(* Snapshots and bookmarks of one dataset. *)
+let survey request handle fsname =
+  let bookmarks =
+    if request.bookmarks then bookmarks handle request fsname else []
+  in
+  if request.holds then
+    match Zfs.list_snapshots handle fsname with
+    | Ok snapshots -> (List.map fst snapshots, bookmarks)
+    | Error (e, what, why) -> ([], Failed (e, what, why) :: bookmarks)
+  else ([], bookmarks)
+
+let holds handle snapname =
+  match Zfs.get_holds handle snapname with
+  | Ok holds ->
+      List.map (fun (tag, time) -> Hold { snapname; tag; time }) holds
+  | Error (e, what, why) -> [ Failed (e, what, why) ]
+
+(*
+ * Call f with the results for the datasets under root (included) as they
+ * come, using a pool of jobs domains.
+ *)
+let scan jobs request root f =
+  let handle = Ioctls.open_handle () in
+  let pool = Parallel.create_pool jobs in
+  let flush chunk =
+    let surveyed =
+      Parallel.pool_map pool (survey request) (Array.of_list (List.rev chunk))
+    in
+    Array.iter (fun (_, bookmarks) -> List.iter f bookmarks) surveyed;
+    let snapnames =
+      Array.to_list surveyed |> List.concat_map fst |> Array.of_list
+    in
+    Array.iter (List.iter f) (Parallel.pool_map pool holds snapnames)
+  in
+  let rec walk name chunk n =
+    let chunk, n =
+      if n + 1 = chunk_size then (
+        flush (name :: chunk);
+        ([], 0))
+      else (name :: chunk, n + 1)
+    in
+    let rec children cookie chunk n =
+      match Zfs.dataset_list_next_simple handle name cookie with
+      | Ok (Some (child, _stats, cookie)) ->
+          let chunk, n = walk child chunk n in
+          children cookie chunk n
+      | Ok None -> (chunk, n)
+      | Error (e, what, why) ->
+          f (Failed (e, what, why));
+          (chunk, n)
+    in
+    children 0L chunk n
+  in
+  Fun.protect
+    ~finally:(fun () -> Parallel.close_pool pool)
+    (fun () ->
+      let chunk, _ = walk root [] 0 in
+      flush chunk)
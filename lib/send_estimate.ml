@@ -0,0 +1,98 @@
+open Error
+
+(*
+ * Batch send size estimation.  Snapshots and bookmarks are immutable, so an
+ * estimate keyed by (fromguid, toguid, flags) never goes stale and can be
+ * kept across planning cycles, even if the snapshots are renamed.
+ *)
+
+type key = int64 option * int64 * Types.lzc_send_flag list
+
+type cache = {
+  table : (key, int64) Hashtbl.t;
+  lock : Mutex.t;
+  hits : int Atomic.t;
+  misses : int Atomic.t;
+}
+
+type estimate = {
+  fromsnap : string option;
+  tosnap : string;
+  space : (int64, zfs_error * string * string) result;
+}
+
+let create_cache () =
+  {
+    table = Hashtbl.create 1024;
+    lock = Mutex.create ();
+    hits = Atomic.make 0;
+    misses = Atomic.make 0;
+  }
+
+let cache_stats cache = (Atomic.get cache.hits, Atomic.get cache.misses)
+
+let cache_find cache key =
+  Mutex.lock cache.lock;
+  let found = Hashtbl.find_opt cache.table key in
+  Mutex.unlock cache.lock;
+  found
+
+let cache_add cache key space =
+  Mutex.lock cache.lock;
+  Hashtbl.replace cache.table key space;
+  Mutex.unlock cache.lock
+
+(*
+ * The guids come from the caller, who has them from listing the snapshots,
+ * so that a cache hit costs no ioctl at all.
+ *)
+let estimate_one cache handle flags fromopt (tosnap, toguid) =
+  let ( let* ) = Result.bind in
+  let key = (Option.map snd fromopt, toguid, Array.to_list flags) in
+  match cache_find cache key with
+  | Some space ->
+      Atomic.incr cache.hits;
+      Ok space
+  | None ->
+      Atomic.incr cache.misses;
+      let fromsnap = Option.map fst fromopt in
+      let* space = Zfs.send_space handle tosnap fromsnap flags in
+      cache_add cache key space;
+      Ok space
+
+(*
+ * Estimate the size of each ((fromsnap, fromguid) option, (tosnap, toguid))
+ * pair using up to jobs domains.  Results are in the same order as pairs.
+ *)
+let estimate_many jobs cache flags pairs =
+  (* Normalize the flags so equivalent flag sets share cache entries. *)
+  let flags = Array.of_list @@ List.sort_uniq compare @@ Array.to_list flags in
+  Parallel.map jobs
+    (fun handle (fromopt, (tosnap, toguid)) ->
+      let space = estimate_one cache handle flags fromopt (tosnap, toguid) in
+      { fromsnap = Option.map fst fromopt; tosnap; space })
+    pairs
+
+(*
+ * Successful estimates, largest first, as wanted by first-fit decreasing
+ * packing of transfers into windows.
+ *)
+let by_size estimates =
+  let sized =
+    Array.to_list estimates
+    |> List.filter_map (fun estimate ->
+           match estimate.space with
+           | Ok space -> Some (estimate.fromsnap, estimate.tosnap, space)
+           | Error _ -> None)
+  in
+  List.stable_sort
+    (fun (_, _, a) (_, _, b) -> Int64.unsigned_compare b a)
+    sized
+
+let total estimates =
+  Array.fold_left
+    (fun acc estimate ->
+      match estimate.space with
+      | Ok space -> Int64.add acc space
+      | Error _ -> acc)
+    0L estimates
@@ -0,0 +1,171 @@
+open Error
+
+(*
+ * Reading the records of a send stream.  Every record starts with a fixed
+ * size dmu_replay_record, possibly followed by a payload whose length
+ * depends on the record type.  Streams produced on a host of the other
+ * endianness are recognized by the byte order of the BEGIN record's magic.
+ *)
+
+let drr_size = 312 (* sizeof (dmu_replay_record_t) *)
+let backup_magic = 0x2F5bacbacL (* DMU_BACKUP_MAGIC *)
+let backup_magic_swapped = 0xaccbbaf502000000L
+
+type record_type =
+  | DrrBegin
+  | DrrObject
+  | DrrFreeobjects
+  | DrrWrite
+  | DrrFree
+  | DrrEnd
+  | DrrWriteByref
+  | DrrSpill
+  | DrrWriteEmbedded
+  | DrrObjectRange
+  | DrrRedact
+
+let record_type_of_int = function
+  | 0 -> Some DrrBegin
+  | 1 -> Some DrrObject
+  | 2 -> Some DrrFreeobjects
+  | 3 -> Some DrrWrite
+  | 4 -> Some DrrFree
+  | 5 -> Some DrrEnd
+  | 6 -> Some DrrWriteByref
+  | 7 -> Some DrrSpill
+  | 8 -> Some DrrWriteEmbedded
+  | 9 -> Some DrrObjectRange
+  | 10 -> Some DrrRedact
+  | _ -> None
+
+type record = {
+  rtype : record_type;
+  offset : int; (* of the header in the stream *)
+  header : bytes; (* drr_size bytes *)
+  payload : bytes;
+}
+
+type reader = {
+  fd : Unix.file_descr;
+  mutable started : bool;
+  mutable swapped : bool;
+  mutable offset : int;
+}
+
+let reader fd = { fd; started = false; swapped = false; offset = 0 }
+
+let get_uint32 swapped buf off =
+  let x =
+    if swapped then Bytes.get_int32_be buf off else Bytes.get_int32_le buf off
+  in
+  Int32.to_int x land 0xffffffff
+
+let get_uint64 swapped buf off =
+  if swapped then Bytes.get_int64_be buf off else Bytes.get_int64_le buf off
+
+let roundup8 n = (n + 7) land lnot 7
+
+(* Fields of the record header, in the reader's byte order. *)
+let uint32 r record off = get_uint32 r.swapped record.header off
+let uint64 r record off = get_uint64 r.swapped record.header off
+
+let payload_length swapped rtype header =
+  let u32 = get_uint32 swapped header in
+  let u64 off = Int64.to_int @@ get_uint64 swapped header off in
+  match rtype with
+  | DrrBegin -> u32 4 (* drr_payloadlen *)
+  | DrrObject ->
+      (* drr_raw_bonuslen or drr_bonuslen *)
+      let raw_bonuslen = u32 36 in
+      if raw_bonuslen != 0 then raw_bonuslen else roundup8 (u32 28)
+  | DrrWrite ->
+      (* drr_compressed_size when drr_compressiontype is set *)
+      if Bytes.get_uint8 header 50 != 0 then u64 96 else u64 32
+  | DrrSpill ->
+      let compressed_size = u64 40 in
+      if compressed_size != 0 then compressed_size else u64 16
+  | DrrWriteEmbedded -> roundup8 (u32 52) (* drr_psize *)
+  | DrrFreeobjects | DrrFree | DrrEnd | DrrWriteByref | DrrObjectRange
+  | DrrRedact ->
+      0
+
+(* Read exactly len bytes unless EOF comes first, returning the count. *)
+let really_read fd buf off len =
+  let rec loop n =
+    if n = len then n
+    else
+      match Unix.read fd buf (off + n) (len - n) with
+      | 0 -> n
+      | m -> loop (n + m)
+      | exception Unix.Unix_error (Unix.EINTR, _, _) -> loop n
+  in
+  loop 0
+
+let really_write fd buf off len =
+  let rec loop n =
+    if n < len then
+      match Unix.write fd buf (off + n) (len - n) with
+      | m -> loop (n + m)
+      | exception Unix.Unix_error (Unix.EINTR, _, _) -> loop n
+  in
+  loop 0
+
+(*
+ * The type and payload length of a record header.  The first header read
+ * must be a BEGIN record, whose magic gives the byte order of the stream.
+ *)
+let decode_header r header =
+  let ( let* ) = Result.bind in
+  let* () =
+    if r.started then Ok ()
+    else
+      let magic = Bytes.get_int64_le header 8 in
+      if Int64.equal magic backup_magic then (
+        r.started <- true;
+        Ok ())
+      else if Int64.equal magic backup_magic_swapped then (
+        r.started <- true;
+        r.swapped <- true;
+        Ok ())
+      else Error (EzfsBadStream, "stream has invalid magic")
+  in
+  match record_type_of_int (get_uint32 r.swapped header 0) with
+  | Some rtype -> Ok (rtype, payload_length r.swapped rtype header)
+  | None -> Error (EzfsBadStream, "stream has an invalid record type")
+
+(* The next record, or None at the end of the stream. *)
+let next r =
+  match
+    let header = Bytes.create drr_size in
+    match really_read r.fd header 0 drr_size with
+    | 0 -> Ok None
+    | n when n < drr_size -> Error (EzfsBadStream, "stream is truncated")
+    | _ ->
+        let ( let* ) = Result.bind in
+        let* rtype, len = decode_header r header in
+        let payload = Bytes.create len in
+        if really_read r.fd payload 0 len < len then
+          Error (EzfsBadStream, "stream is truncated")
+        else
+          let record = { rtype; offset = r.offset; header; payload } in
+          r.offset <- r.offset + drr_size + len;
+          Ok (Some record)
+  with
+  | result -> result
+  | exception Unix.Unix_error (errno, _, _) -> Error (zfs_standard_error errno)
+
+let record_length record = drr_size + Bytes.length record.payload
+
+(*
+ * The object a record applies to, or the first object of the range for
+ * FREEOBJECTS and OBJECT_RANGE records.
+ *)
+let record_object r record =
+  match record.rtype with
+  | DrrBegin | DrrEnd -> None
+  | _ -> Some (uint64 r record 8)
+
+(* drr_toguid and drr_fromguid of a BEGIN record *)
+let begin_guids r record =
+  assert (record.rtype = DrrBegin);
+  (uint64 r record 40, uint64 r record 48)
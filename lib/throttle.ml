@@ -0,0 +1,28 @@
+(*
+ * A token bucket limiting throughput to rate bytes per second, with bursts
+ * of up to one second worth of tokens.  It may be shared between domains to
+ * enforce a global limit on several streams.
+ *)
+
+type t = {
+  rate : float;
+  mutable tokens : float;
+  mutable last : float;
+  lock : Mutex.t;
+}
+
+let create rate =
+  let rate = Float.of_int rate in
+  { rate; tokens = rate; last = Unix.gettimeofday (); lock = Mutex.create () }
+
+(* Take n tokens, sleeping until the debt incurred has been paid off. *)
+let consume t n =
+  Mutex.lock t.lock;
+  let now = Unix.gettimeofday () in
+  let refill = (now -. t.last) *. t.rate in
+  let tokens = Float.min t.rate (t.tokens +. refill) in
+  t.last <- now;
+  t.tokens <- tokens -. Float.of_int n;
+  Mutex.unlock t.lock;
+  let deficit = Float.of_int n -. tokens in
+  if deficit > 0. then Unix.sleepf (deficit /. t.rate)
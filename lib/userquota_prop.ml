@@ -41,29 +41,96 @@ let to_string = function
   | Projectobjused -> "projectobjused"
   | Projectobjquota -> "projectoboquota"
 
+(*
+ * User and group names are resolved through NSS, which may go to the
+ * network, so resolutions are cached for the process.  Names that do not
+ * resolve are cached too, for a shorter time, so that numeric ids and
+ * unknown names do not repeat the lookup either.
+ *)
+type name_kind = User | Group
+
+type name_cache = {
+  entries : (name_kind * string, int option * float) Hashtbl.t;
+  lock : Mutex.t;
+  mutable ttl : float;
+  mutable negative_ttl : float;
+}
+
+let name_cache =
+  {
+    entries = Hashtbl.create 64;
+    lock = Mutex.create ();
+    ttl = 300.;
+    negative_ttl = 30.;
+  }
+
+let set_name_cache_ttl ttl negative_ttl =
+  Mutex.lock name_cache.lock;
+  name_cache.ttl <- ttl;
+  name_cache.negative_ttl <- negative_ttl;
+  Mutex.unlock name_cache.lock
+
+let flush_name_cache () =
+  Mutex.lock name_cache.lock;
+  Hashtbl.reset name_cache.entries;
+  Mutex.unlock name_cache.lock
+
+let lookup_name kind name =
+  try
+    Some
+      (match kind with
+      | User -> (Unix.getpwnam name).pw_uid
+      | Group -> (Unix.getgrnam name).gr_gid)
+  with Not_found -> None
+
+let resolve_name kind name =
+  let now = Unix.gettimeofday () in
+  Mutex.lock name_cache.lock;
+  let entry = Hashtbl.find_opt name_cache.entries (kind, name) in
+  Mutex.unlock name_cache.lock;
+  match entry with
+  | Some (id, expires) when now < expires -> id
+  | _ ->
+      let id = lookup_name kind name in
+      Mutex.lock name_cache.lock;
+      let ttl =
+        if Option.is_some id then name_cache.ttl else name_cache.negative_ttl
+      in
+      Hashtbl.replace name_cache.entries (kind, name) (id, now +. ttl);
+      Mutex.unlock name_cache.lock;
+      id
+
 let decode_propname s zoned =
   let ( >>= ) = Option.bind in
+  let decode prop kind ident =
+    match resolve_name kind ident with
+    | Some id -> if zoned && Util.zoneid () != 0 then None else Some (prop, id)
+    | None -> Scanf.sscanf_opt ident "%d%!" (fun rid -> (prop, rid))
+  in
   Option.join
   @@ Scanf.sscanf_opt s "%s@@%s" (fun propname ident ->
          of_string_opt propname >>= fun prop ->
          match prop with
-         | Userused | Userquota | Userobjused | Userobjquota -> (
-             try
-               let pw = Unix.getpwnam ident in
-               if zoned && Util.getzoneid () != 0 then None
-               else Some (prop, pw.pw_uid)
-             with Not_found ->
-               Scanf.sscanf_opt ident "%d%!" (fun rid -> (prop, rid)))
-         | Groupused | Groupquota | Groupobjused | Groupobjquota -> (
-             try
-               let gr = Unix.getgrnam ident in
-               if zoned && Util.getzoneid () != 0 then None
-               else Some (prop, gr.gr_gid)
-             with Not_found ->
-               Scanf.sscanf_opt ident "%d%!" (fun rid -> (prop, rid)))
+         | Userused | Userquota | Userobjused | Userobjquota ->
+             decode prop User ident
+         | Groupused | Groupquota | Groupobjused | Groupobjquota ->
+             decode prop Group ident
          | Projectused | Projectquota | Projectobjused | Projectobjquota ->
              Scanf.sscanf_opt ident "%d%!" (fun rid -> (prop, rid)))
 
+(* Decode many property names, looking each distinct name up once. *)
+let decode_propnames names zoned =
+  let decoded = Hashtbl.create (Array.length names) in
+  Array.map
+    (fun s ->
+      match Hashtbl.find_opt decoded s with
+      | Some result -> result
+      | None ->
+          let result = decode_propname s zoned in
+          Hashtbl.replace decoded s result;
+          result)
+    names
+
 let encode_propname prop rid domain =
   Printf.sprintf "%s@%x-%s" (to_string prop) rid domain
 
@@ -1,10 +1,15 @@
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/sysctl.h>
 #include <grp.h>
 #include <pwd.h>
+#include <sha256.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <zlib.h>
 #include <caml/mlvalues.h>
 #include <caml/alloc.h>
+#include <caml/bigarray.h>
 #include <caml/fail.h>
 #include <caml/memory.h>
 #include <caml/threads.h>
@@ -60,3 +65,98 @@ caml_zfs_util_error_of_int(value errn)
 
 	CAMLreturn (caml_unix_error_of_code(code));
 }
+
+CAMLprim value
+caml_zfs_util_uncompress(value src, value len)
+{
+	CAMLparam2 (src, len);
+	CAMLlocal2 (dst, ret);
+	uLongf dstlen;
+	int err;
+
+	if (Long_val(len) < 0) {
+		CAMLreturn (Val_none);
+	}
+	dstlen = Long_val(len);
+	dst = caml_alloc_string(dstlen);
+	err = uncompress((Bytef *)Bytes_val(dst), &dstlen,
+	    (const Bytef *)Bytes_val(src), caml_string_length(src));
+	if (err != Z_OK || dstlen != (uLongf)Long_val(len)) {
+		CAMLreturn (Val_none);
+	}
+	ret = caml_alloc_some(dst);
+	CAMLreturn (ret);
+}
+
+/*
+ * Allocate a byte Bigarray aligned to the largest supported page size, so
+ * the VM can promote it to superpages, falling back to base pages.
+ */
+CAMLprim value
+caml_zfs_util_alloc_buffer(value size)
+{
+	CAMLparam1 (size);
+	size_t pagesizes[MAXPAGESIZES];
+	size_t align, len;
+	void *data;
+	int n;
+
+	len = Long_val(size);
+	n = getpagesizes(pagesizes, MAXPAGESIZES);
+	align = n > 0 ? pagesizes[n - 1] : getpagesize();
+	if (len < align || posix_memalign(&data, align, len) != 0) {
+		if (posix_memalign(&data, getpagesize(), len) != 0) {
+			caml_raise_out_of_memory();
+		}
+	}
+	CAMLreturn (caml_ba_alloc_dims(CAML_BA_CHAR | CAML_BA_C_LAYOUT |
+	    CAML_BA_MANAGED, 1, data, len));
+}
+
+CAMLprim value
+caml_zfs_util_read_bigarray(value desc, value buf, value ofs, value len)
+{
+	CAMLparam4 (desc, buf, ofs, len);
+	char *data;
+	ssize_t n;
+
+	data = (char *)Caml_ba_data_val(buf) + Long_val(ofs);
+	caml_release_runtime_system();
+	n = read(Int_val(desc), data, Long_val(len));
+	caml_acquire_runtime_system();
+	if (n == -1) {
+		caml_uerror("read", Nothing);
+	}
+	CAMLreturn (Val_long(n));
+}
+
+CAMLprim value
+caml_zfs_util_write_bigarray(value desc, value buf, value ofs, value len)
+{
+	CAMLparam4 (desc, buf, ofs, len);
+	char *data;
+	ssize_t n;
+
+	data = (char *)Caml_ba_data_val(buf) + Long_val(ofs);
+	caml_release_runtime_system();
+	n = write(Int_val(desc), data, Long_val(len));
+	caml_acquire_runtime_system();
+	if (n == -1) {
+		caml_uerror("write", Nothing);
+	}
+	CAMLreturn (Val_long(n));
+}
+
+CAMLprim value
+caml_zfs_util_sha256(value buf, value ofs, value len)
+{
+	CAMLparam3 (buf, ofs, len);
+	CAMLlocal1 (digest);
+	SHA256_CTX ctx;
+
+	digest = caml_alloc_string(SHA256_DIGEST_LENGTH);
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, Bytes_val(buf) + Long_val(ofs), Long_val(len));
+	SHA256_Final((unsigned char *)Bytes_val(digest), &ctx);
+	CAMLreturn (digest);
+}
@@ -61,9 +61,61 @@ external int_of_pool_trim_func : pool_trim_func -> int
 
 external get_system_hostid : unit -> int32 = "caml_zfs_util_get_system_hostid"
 external getzoneid : unit -> int = "caml_zfs_util_getzoneid"
+
+(* A process cannot change zones (jails), so its zone id is looked up once. *)
+let zoneid =
+  let cached = Atomic.make (-1) in
+  fun () ->
+    match Atomic.get cached with
+    | -1 ->
+        let id = getzoneid () in
+        Atomic.set cached id;
+        id
+    | id -> id
 external error_of_int : int -> Unix.error = "caml_zfs_util_error_of_int"
 external int_of_objset_type : objset_type -> int = "caml_zfs_util_int_of_t"
 
+(* uncompress src len inflates zlib data to exactly len bytes *)
+external uncompress : bytes -> int -> bytes option = "caml_zfs_util_uncompress"
+
+type buffer =
+  (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+(* alloc_buffer size allocates a superpage aligned buffer where possible *)
+external alloc_buffer : int -> buffer = "caml_zfs_util_alloc_buffer"
+
+external unsafe_read_buffer : Unix.file_descr -> buffer -> int -> int -> int
+  = "caml_zfs_util_read_bigarray"
+
+external unsafe_write_buffer : Unix.file_descr -> buffer -> int -> int -> int
+  = "caml_zfs_util_write_bigarray"
+
+let check_buffer_range buf ofs len =
+  if ofs < 0 || len < 0 || ofs > Bigarray.Array1.dim buf - len then
+    invalid_arg "buffer range"
+
+(* read_buffer and write_buffer are Unix.read and Unix.write for buffers *)
+let read_buffer fd buf ofs len =
+  check_buffer_range buf ofs len;
+  unsafe_read_buffer fd buf ofs len
+
+let write_buffer fd buf ofs len =
+  check_buffer_range buf ofs len;
+  unsafe_write_buffer fd buf ofs len
+
+external unsafe_sha256 : bytes -> int -> int -> string = "caml_zfs_util_sha256"
+
+(* sha256 buf ofs len is the raw SHA-256 digest of the given range *)
+let sha256 buf ofs len =
+  if ofs < 0 || len < 0 || ofs > Bytes.length buf - len then
+    invalid_arg "Util.sha256";
+  unsafe_sha256 buf ofs len
+
+let hex_of_string s =
+  String.to_seq s
+  |> Seq.map (fun c -> Printf.sprintf "%02x" (Char.code c))
+  |> List.of_seq |> String.concat ""
+
 let nicestrtonum s =
   let shiftamt suffix =
     match String.uppercase_ascii suffix with
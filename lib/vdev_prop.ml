@@ -118,7 +118,7 @@ type attributes = {
   index_table : (string * int64) array;
 }
 
-let attributes =
+let make_attributes =
   let empty_index_table = [||] in
   let boolean_values = Some "on | off" in
   let boolean_index_table = [| ("off", 0L); ("on", 1L) |] in
@@ -762,12 +762,72 @@ let attributes =
         index_table = empty_index_table;
       }
 
-let to_string prop = (attributes prop).name
+external int_of_t : t -> int = "caml_zfs_util_int_of_t"
+
+(* Every constructor in declaration order, so all_props.(int_of_t p) = p. *)
+let all_props =
+  [|
+    Allocated;
+    Allocating;
+    Ashift;
+    Asize;
+    Bootsize;
+    Bytes_claim;
+    Bytes_free;
+    Bytes_null;
+    Bytes_read;
+    Bytes_trim;
+    Bytes_write;
+    Capacity;
+    Checksum_errors;
+    Checksum_n;
+    Checksum_t;
+    Children;
+    Comment;
+    Devid;
+    Enc_path;
+    Expandsz;
+    Failfast;
+    Fragmentation;
+    Free;
+    Fru;
+    Guid;
+    Initialize_errors;
+    Inval;
+    Io_n;
+    Io_t;
+    Name;
+    Numchildren;
+    Ops_claim;
+    Ops_free;
+    Ops_null;
+    Ops_read;
+    Ops_trim;
+    Ops_write;
+    Parent;
+    Parity;
+    Path;
+    Phys_path;
+    Psize;
+    Raidz_expanding;
+    Read_errors;
+    Removing;
+    Size;
+    Slow_io_n;
+    Slow_io_t;
+    State;
+    Userprop;
+    Write_errors;
+  |]
 
-let string_to_index prop str =
-  (attributes prop).index_table
-  |> Array.find_map (fun (s, i) -> if s = str then Some i else None)
+(* Inval and Userprop have no attributes. *)
+let table =
+  Prop_table.create all_props
+    (function Inval | Userprop -> None | prop -> Some (make_attributes prop))
+    (fun attributes -> attributes.index_table)
 
-let index_to_string prop idx =
-  (attributes prop).index_table
-  |> Array.find_map (fun (s, i) -> if i = idx then Some s else None)
+let entry prop = Prop_table.find table (int_of_t prop)
+let attributes prop = (entry prop).attributes
+let to_string prop = (attributes prop).name
+let string_to_index prop str = Prop_table.string_to_index (entry prop) str
+let index_to_string prop idx = Prop_table.index_to_string (entry prop) idx
@@ -615,3 +615,25 @@ let all_features =
     Zilsaxattr;
     Zstd_compress;
   |]
+
+external int_of_t : t -> int = "caml_zfs_util_int_of_t"
+
+(*
+ * Sets of features as the bits of an int, bit int_of_t f for feature f, so
+ * that intersections and membership tests are single machine operations.
+ *)
+type set = int
+
+let () =
+  assert (Array.for_all (fun f -> int_of_t f < Sys.int_size) all_features)
+
+let empty_set = 0
+let set_add feature set = set lor (1 lsl int_of_t feature)
+let set_mem feature set = set land (1 lsl int_of_t feature) <> 0
+let set_inter a b = a land b
+
+let full_set =
+  Array.fold_left (fun set f -> set_add f set) empty_set all_features
+
+let set_to_list set =
+  Array.to_list all_features |> List.filter (fun f -> set_mem f set)
@@ -102,44 +102,117 @@ let snapshot_list_next handle name cookie =
       let what = "failed to list next snapshot" in
       Error (e, what, why)
 
-let set handle name props dataset_type zoned =
-  let ( let* ) = Result.bind in
+let list_children handle name =
+  let rec iter_children cookie list =
+    match dataset_list_next_simple handle name cookie with
+    | Ok (Some (child, stats, next_cookie)) ->
+        iter_children next_cookie ((child, stats) :: list)
+    | Ok None -> Ok (List.rev list)
+    | Error e -> Error e
+  in
+  iter_children 0L []
+
+(* Snapshots are returned oldest first. *)
+let list_snapshots handle name =
+  let rec iter_snapshots cookie list =
+    match snapshot_list_next_simple handle name cookie with
+    | Ok (Some (snapname, stats, next_cookie)) ->
+        iter_snapshots next_cookie ((snapname, stats) :: list)
+    | Ok None ->
+        Ok
+          (List.sort
+             (fun (_, a) (_, b) ->
+               Int64.unsigned_compare a.Types.creation_txg
+                 b.Types.creation_txg)
+             list)
+    | Error e -> Error e
+  in
+  iter_snapshots 0L []
+
+(* Snapshots with their props, oldest first. *)
+let list_snapshots_props handle name =
+  let rec iter_snapshots cookie list =
+    match snapshot_list_next handle name cookie with
+    | Ok (Some (snapname, stats, props, next_cookie)) ->
+        iter_snapshots next_cookie ((snapname, stats, props) :: list)
+    | Ok None ->
+        Ok
+          (List.sort
+             (fun (_, a, _) (_, b, _) ->
+               Int64.unsigned_compare a.Types.creation_txg
+                 b.Types.creation_txg)
+             list)
+    | Error e -> Error e
+  in
+  iter_snapshots 0L []
+
+(* The value of a numeric property in the props of a listing. *)
+let uint64_prop props name =
+  Option.bind (Nvlist.lookup_nvlist props name) (fun prop ->
+      Nvlist.lookup_uint64 prop "value")
+
+(* The space destroying firstsnap through lastsnap would free. *)
+let snaprange_space handle firstsnap lastsnap =
+  let args = Nvlist.alloc () in
+  Nvlist.add_string args "firstsnap" firstsnap;
+  match Ioctls.space_snaps handle lastsnap Nvlist.(pack args Native) with
+  | Ok packed -> (
+      match Nvlist.lookup_uint64 (Nvlist.unpack packed) "used" with
+      | Some used -> Ok used
+      | None -> failwith "space_snaps failed to return used")
+  | Error errno ->
+      let e, why = zfs_standard_error errno in
+      let what =
+        Printf.sprintf "cannot get space of '%s' through '%s'" firstsnap
+          lastsnap
+      in
+      Error (e, what, why)
+
+let set_prop_errors packed_errors =
+  let errors = Nvlist.unpack packed_errors in
+  let rec format_description prev e list =
+    match Nvlist.next_nvpair errors prev with
+    | Some pair ->
+        let propname = Nvpair.name pair in
+        let prop = Zfs_prop.of_string propname in
+        (*
+         * XXX: libzfs ignores the individual errors and uses
+         * errno from the ioctl for all props instead.
+         *)
+        let errno = Nvpair.value_int32 pair |> Int32.to_int in
+        let error = Util.error_of_int errno in
+        let e, why = Zfs_prop.zfs_setprop_error prop error in
+        let msg = Printf.sprintf "%s: %s" propname why in
+        format_description (Some pair) e (msg :: list)
+    | None -> (e, String.concat "\n" (List.rev list))
+  in
+  format_description None EzfsBadProp []
+
+(* Set props already validated and packed for the kernel. *)
+let set_packed handle name packed_props =
   match
-    let create = false in
-    let keyok = false in
-    let* props = Zfs_prop.validate props dataset_type zoned create keyok in
-    (* XXX: libzfs automates reservation if volsize is being set *)
-    match
-      let packed_props = Nvlist.(pack props Native) in
-      Ioctls.set_prop handle name packed_props
-    with
+    match Ioctls.set_prop handle name packed_props with
     | Ok () -> Ok ()
     | Error (None, errno) -> Error (zfs_standard_error errno)
     | Error (Some packed_errors, _errno) ->
-        let errors = Nvlist.unpack packed_errors in
-        let rec format_description prev e list =
-          match Nvlist.next_nvpair errors prev with
-          | Some pair ->
-              let propname = Nvpair.name pair in
-              let prop = Zfs_prop.of_string propname in
-              (*
-               * XXX: libzfs ignores the individual errors and uses
-               * errno from the ioctl for all props instead.
-               *)
-              let errno = Nvpair.value_int32 pair |> Int32.to_int in
-              let error = Util.error_of_int errno in
-              let e, why = Zfs_prop.zfs_setprop_error prop error in
-              let msg = Printf.sprintf "%s: %s" propname why in
-              format_description (Some pair) e (msg :: list)
-          | None -> (e, String.concat "\n" (List.rev list))
-        in
-        Error (format_description None EzfsBadProp [])
+        Error (set_prop_errors packed_errors)
   with
   | Ok () -> Ok ()
   | Error (e, why) ->
       let what = Printf.sprintf "failed to set props for '%s'" name in
       Error (e, what, why)
 
+let set handle name props dataset_type zoned =
+  let create = false in
+  let keyok = false in
+  match Zfs_prop.validate props dataset_type zoned create keyok with
+  | Ok props ->
+      (* XXX: libzfs automates reservation if volsize is being set *)
+      set_packed handle name Nvlist.(pack props Native)
+  | Error (e, why) ->
+      let what = Printf.sprintf "failed to set props for '%s'" name in
+      Error (e, what, why)
+
 let create handle name propsopt dataset_type zoned =
   let ( let* ) = Result.bind in
   match
@@ -196,6 +269,631 @@ let create handle name propsopt dataset_type zoned =
       let what = Printf.sprintf "cannot create '%s'" name in
       Error (e, what, why)
 
+(*
+ * Bulk snapshots.  A snapshot ioctl is atomic, creating all of its snapshots
+ * in one txg or none of them, and takes snapshots of one pool with at most
+ * one per filesystem.  snapshot_many splits the names into such groups of
+ * at most max_group snapshots, small enough that their arguments do not
+ * exceed the kernel's limit on packed nvlists.  When the kernel rejects a
+ * group it is retried without the snapshots blamed in the error nvlist, so
+ * every group committed is the largest that could be.
+ *)
+type snapshot_failure = { snapname : string; error : zfs_error; why : string }
+
+type snapshot_group = {
+  size : int;
+  latency : float; (* seconds spent in the ioctl *)
+  committed : bool;
+}
+
+type snapshot_report = {
+  created : string list;
+  failures : snapshot_failure list;
+  txgs : int; (* one per committed group *)
+  groups : snapshot_group list; (* in the order they were issued *)
+}
+
+let pool_of_name name =
+  List.hd @@ String.split_on_char '/' @@ List.hd @@ String.split_on_char '@'
+  @@ List.hd @@ String.split_on_char '#' name
+
+let chunk max_size items =
+  let max_size = max 1 max_size in
+  let rec split n current acc = function
+    | [] ->
+        List.rev (if current = [] then acc else List.rev current :: acc)
+    | item :: rest when n = max_size ->
+        split 1 [ item ] (List.rev current :: acc) rest
+    | item :: rest -> split (n + 1) (item :: current) acc rest
+  in
+  split 0 [] [] items
+
+(*
+ * The kernel refuses ioctl arguments that pack to more than
+ * zfs_max_nvlist_src_size with EINVAL, which cannot be told apart from
+ * other invalid arguments.  Batches are kept under the smallest default of
+ * that limit, a quarter of 64M of memory, with room for other arguments.
+ *)
+let max_args_size = 15 * 1024 * 1024
+
+(* The native encoding of a pair named name with value_size bytes of value. *)
+let nvpair_size name value_size =
+  let roundup8 n = (n + 7) land lnot 7 in
+  16 + roundup8 (String.length name + 1) + roundup8 value_size
+
+(*
+ * Split names into groups of at most max_group, each packing to at most
+ * max_args_size as nvpairs with value_size bytes of value.
+ *)
+let chunk_args max_group value_size names =
+  let max_group = max 1 max_group in
+  let rec split n bytes current acc = function
+    | [] ->
+        List.rev (if current = [] then acc else List.rev current :: acc)
+    | name :: rest ->
+        let size = nvpair_size name value_size in
+        if current <> [] && (n = max_group || bytes + size > max_args_size)
+        then split 1 size [ name ] (List.rev current :: acc) rest
+        else split (n + 1) (bytes + size) (name :: current) acc rest
+  in
+  split 0 0 [] [] names
+
+(* Names grouped by pool, pools in order of first appearance. *)
+let group_by_pool names =
+  let pools = Hashtbl.create 8 in
+  let order =
+    List.fold_left
+      (fun order name ->
+        let pool = pool_of_name name in
+        match Hashtbl.find_opt pools pool with
+        | Some names ->
+            Hashtbl.replace pools pool (name :: names);
+            order
+        | None ->
+            Hashtbl.replace pools pool [ name ];
+            pool :: order)
+      [] names
+  in
+  List.rev_map (fun pool -> (pool, List.rev (Hashtbl.find pools pool))) order
+
+(* Per-name errnos from the error nvlist of a batched ioctl. *)
+let batch_errors packed_errors =
+  let errors = Nvlist.unpack packed_errors in
+  let rec collect prev acc =
+    match Nvlist.next_nvpair errors prev with
+    | Some pair ->
+        let errno = Int32.to_int @@ Nvpair.value_int32 pair in
+        let errno = Util.error_of_int errno in
+        collect (Some pair) ((Nvpair.name pair, errno) :: acc)
+    | None -> List.rev acc
+  in
+  collect None []
+
+let name_set names =
+  let set = Hashtbl.create (List.length names) in
+  List.iter (fun name -> Hashtbl.replace set name ()) names;
+  set
+
+(* The per-name errnos of the error nvlist for names of the batch. *)
+let blamed_errors packed_errors names =
+  let batch = name_set names in
+  List.filter
+    (fun (name, _) -> Hashtbl.mem batch name)
+    (batch_errors packed_errors)
+
+(* names without those blamed. *)
+let unblamed names blamed =
+  let blamed = name_set (List.map fst blamed) in
+  List.filter (fun name -> not (Hashtbl.mem blamed name)) names
+
+let snapshot_failure snapname errno =
+  let error, why =
+    match errno with
+    | Unix.EEXIST -> (EzfsExists, "snapshot already exists")
+    | Unix.ENOENT -> (EzfsNoEnt, "dataset does not exist")
+    | errno -> zfs_standard_error errno
+  in
+  { snapname; error; why }
+
+(*
+ * The props are validated for snapshots as zfs_snapshot_nvl does, and if
+ * they are invalid every snapshot fails with the reason.
+ *)
+let snapshot_many handle snapnames propsopt max_group =
+  let issue propsopt pool names =
+    let args = Nvlist.alloc () in
+    let snaps = Nvlist.alloc () in
+    List.iter (Nvlist.add_boolean snaps) names;
+    Nvlist.add_nvlist args "snaps" snaps;
+    Option.iter (Nvlist.add_nvlist args "props") propsopt;
+    let start = Unix.gettimeofday () in
+    let result = Ioctls.snapshot handle pool Nvlist.(pack args Native) in
+    (result, Unix.gettimeofday () -. start)
+  in
+  let rec attempt propsopt pool names report =
+    if names = [] then report
+    else
+      let result, latency = issue propsopt pool names in
+      let group =
+        { size = List.length names; latency; committed = Result.is_ok result }
+      in
+      let report = { report with groups = group :: report.groups } in
+      let fail_all errno =
+        let failures =
+          List.map (fun name -> snapshot_failure name errno) names
+        in
+        { report with failures = List.rev_append failures report.failures }
+      in
+      match result with
+      | Ok () ->
+          {
+            report with
+            created = List.rev_append names report.created;
+            txgs = report.txgs + 1;
+          }
+      | Error (Some packed_errors, errno) -> (
+          match blamed_errors packed_errors names with
+          | [] -> fail_all errno
+          | blamed ->
+              let failures =
+                List.map
+                  (fun (name, errno) -> snapshot_failure name errno)
+                  blamed
+              in
+              let failures = List.rev_append failures report.failures in
+              let rest = unblamed names blamed in
+              attempt propsopt pool rest { report with failures })
+      | Error (None, errno) -> fail_all errno
+  in
+  (* The n-th snapshot of a filesystem goes into the n-th round. *)
+  let rounds names =
+    let seen = Hashtbl.create (List.length names) in
+    let tagged =
+      List.map
+        (fun name ->
+          let fs = List.hd @@ String.split_on_char '@' name in
+          let n = Option.value ~default:0 (Hashtbl.find_opt seen fs) in
+          Hashtbl.replace seen fs (n + 1);
+          (n, name))
+        names
+    in
+    let last = Hashtbl.fold (fun _ n acc -> max n acc) seen 0 in
+    List.init last (fun round ->
+        List.filter_map
+          (fun (n, name) -> if n = round then Some name else None)
+          tagged)
+  in
+  let invalid, valid =
+    List.partition (fun name -> not (String.contains name '@')) snapnames
+  in
+  let report =
+    {
+      created = [];
+      failures =
+        List.map
+          (fun snapname ->
+            { snapname; error = EzfsInvalidName; why = "not a snapshot name" })
+          invalid;
+      txgs = 0;
+      groups = [];
+    }
+  in
+  let validated =
+    match propsopt with
+    | Some props ->
+        Result.map Option.some
+          (Zfs_prop.validate props Snapshot false false false)
+    | None -> Ok None
+  in
+  let report =
+    match validated with
+    | Ok propsopt ->
+        List.fold_left
+          (fun report (pool, names) ->
+            List.fold_left
+              (fun report round ->
+                List.fold_left
+                  (fun report group -> attempt propsopt pool group report)
+                  report
+                  (chunk_args max_group 0 round))
+              report (rounds names))
+          report (group_by_pool valid)
+    | Error (error, why) ->
+        let failures =
+          List.map (fun snapname -> { snapname; error; why }) valid
+        in
+        { report with failures = List.rev_append failures report.failures }
+  in
+  {
+    report with
+    created = List.rev report.created;
+    failures = List.rev report.failures;
+    groups = List.rev report.groups;
+  }
+
+(*
+ * Run issue on the names of one pool, retrying without the names blamed
+ * in the error nvlist.  Blamed names whose errno satisfies ok are not
+ * failures but excused.  Returns the failures and the excused names,
+ * added to those given.
+ *)
+let rec retry_batch issue pool names ok (failures, excused) =
+  if names = [] then (failures, excused)
+  else
+    let fail_all errno =
+      List.rev_append
+        (List.map (fun name -> snapshot_failure name errno) names)
+        failures
+    in
+    match issue pool names with
+    | Ok () -> (failures, excused)
+    | Error (Some packed_errors, errno) -> (
+        match blamed_errors packed_errors names with
+        | [] -> (fail_all errno, excused)
+        | blamed ->
+            let failures, excused =
+              List.fold_left
+                (fun (failures, excused) (name, errno) ->
+                  if ok errno then (failures, name :: excused)
+                  else (snapshot_failure name errno :: failures, excused))
+                (failures, excused) blamed
+            in
+            retry_batch issue pool (unblamed names blamed) ok
+              (failures, excused))
+    | Error (None, errno) -> (fail_all errno, excused)
+
+(*
+ * Bulk snapshot destroy for retention sweeps.  Snapshots are grouped by
+ * pool into batches of at most max_group, and the batches are issued on up
+ * to jobs domains.  destroy_snaps is atomic too, so a rejected batch is
+ * retried without the snapshots blamed in the error nvlist.  Those that
+ * were busy (held, EBUSY) or had clones (EEXIST) are retried with defer,
+ * which destroys them once released; the others are reported as failures.
+ *
+ * Space reclaimed is read before anything is destroyed, from one listing
+ * of the snapshots of each filesystem involved.  A snapshot destroyed on
+ * its own frees its used space, and a run of adjacent snapshots destroyed
+ * together frees what space_snaps reports for the run, which includes the
+ * space they shared.  When only part of a run was destroyed the used
+ * space of those destroyed stands in, a lower bound.
+ *)
+type destroy_report = {
+  destroyed : string list;
+  deferred : string list; (* destroyed or marked for deferred destroy *)
+  rejected : snapshot_failure list;
+  reclaimed : int64; (* bytes *)
+  elapsed : float;
+}
+
+let destroy_batch handle pool names =
+  let issue defer pool names =
+    let args = Nvlist.alloc () in
+    let snaps = Nvlist.alloc () in
+    List.iter (Nvlist.add_boolean snaps) names;
+    Nvlist.add_nvlist args "snaps" snaps;
+    if defer then Nvlist.add_boolean args "defer";
+    Ioctls.destroy_snaps handle pool Nvlist.(pack args Native)
+  in
+  let busy errno = errno = Unix.EBUSY || errno = Unix.EEXIST in
+  let failures, retry =
+    retry_batch (issue false) pool names busy ([], [])
+  in
+  let failures, _ =
+    retry_batch (issue true) pool (List.rev retry) (fun _ -> false)
+      (failures, [])
+  in
+  let failed = name_set (List.map (fun f -> f.snapname) failures) in
+  let retried = name_set retry in
+  let destroyed =
+    List.filter
+      (fun name -> not (Hashtbl.mem failed name || Hashtbl.mem retried name))
+      names
+  in
+  let deferred =
+    List.filter (fun name -> not (Hashtbl.mem failed name)) (List.rev retry)
+  in
+  (destroyed, deferred, List.rev failures)
+
+(*
+ * The runs of adjacent snapshots of fsname in names, oldest first, each
+ * with the used space of its snapshots and the space destroying the whole
+ * run frees.
+ *)
+let destroy_runs names handle fsname =
+  let ( let* ) = Result.bind in
+  let* snapshots = list_snapshots_props handle fsname in
+  let close run runs = if run = [] then runs else List.rev run :: runs in
+  let run, runs =
+    List.fold_left
+      (fun (run, runs) (name, _stats, props) ->
+        if Hashtbl.mem names name then
+          let used = Option.value ~default:0L (uint64_prop props "used") in
+          ((name, used) :: run, runs)
+        else ([], close run runs))
+      ([], []) snapshots
+  in
+  let runs = List.rev (close run runs) in
+  List.fold_left
+    (fun acc run ->
+      let* acc = acc in
+      match run with
+      | [ (_, used) ] -> Ok ((run, used) :: acc)
+      | _ ->
+          let first, _ = List.hd run in
+          let last, _ = List.nth run (List.length run - 1) in
+          let* freed = snaprange_space handle first last in
+          Ok ((run, freed) :: acc))
+    (Ok []) runs
+  |> Result.map List.rev
+
+(* The space freed by the runs, given the snapshots actually destroyed. *)
+let reclaimed_space destroyed runs =
+  List.fold_left
+    (fun total (run, freed) ->
+      let gone =
+        List.filter (fun (name, _) -> Hashtbl.mem destroyed name) run
+      in
+      let freed =
+        if List.length gone = List.length run then freed
+        else List.fold_left (fun sum (_, used) -> Int64.add sum used) 0L gone
+      in
+      Int64.add total freed)
+    0L runs
+
+let destroy_snaps_many jobs snapnames max_group =
+  let start = Unix.gettimeofday () in
+  let invalid, valid =
+    List.partition (fun name -> not (String.contains name '@')) snapnames
+  in
+  let filesystems =
+    List.sort_uniq String.compare
+    @@ List.map (fun name -> List.hd @@ String.split_on_char '@' name) valid
+    |> Array.of_list
+  in
+  let runs = Parallel.map jobs (destroy_runs (name_set valid)) filesystems in
+  let batches =
+    List.concat_map
+      (fun (pool, names) ->
+        List.map (fun batch -> (pool, batch)) (chunk_args max_group 0 names))
+      (group_by_pool valid)
+    |> Array.of_list
+  in
+  let results =
+    Parallel.map jobs
+      (fun handle (pool, names) -> destroy_batch handle pool names)
+      batches
+  in
+  let destroyed, deferred, rejected =
+    Array.fold_left
+      (fun (destroyed, deferred, rejected) (d, f, r) ->
+        (d :: destroyed, f :: deferred, r :: rejected))
+      ([], [], []) results
+  in
+  let destroyed = List.concat (List.rev destroyed) in
+  let gone = name_set destroyed in
+  let reclaimed =
+    Array.fold_left
+      (fun total runs ->
+        match runs with
+        | Ok runs -> Int64.add total (reclaimed_space gone runs)
+        | Error _ -> total)
+      0L runs
+  in
+  let invalid =
+    List.map
+      (fun snapname ->
+        { snapname; error = EzfsInvalidName; why = "not a snapshot name" })
+      invalid
+  in
+  {
+    destroyed;
+    deferred = List.concat (List.rev deferred);
+    rejected = invalid @ List.concat (List.rev rejected);
+    reclaimed;
+    elapsed = Unix.gettimeofday () -. start;
+  }
+
+(*
+ * Put a user hold with tag on each of snapnames, one ioctl per pool.  Holds
+ * taken with a cleanup fd (a descriptor of /dev/zfs opened with O_EXCL)
+ * are released by the kernel when it is closed, including when the
+ * process dies.  Snapshots already held with tag count as held.  The kernel
+ * skips snapshots that do not exist without failing the ioctl, listing
+ * them in the error nvlist, and they are reported as failures.
+ *)
+let hold_many handle tag snapnames cleanup_fdopt =
+  let skipped = ref [] in
+  let issue pool names =
+    let args = Nvlist.alloc () in
+    let holds = Nvlist.alloc () in
+    List.iter (fun name -> Nvlist.add_string holds name tag) names;
+    Nvlist.add_nvlist args "holds" holds;
+    Option.iter
+      (fun fd ->
+        Nvlist.add_int32 args "cleanup_fd"
+          (Int32.of_int (Util.int_of_descr fd)))
+      cleanup_fdopt;
+    match Ioctls.hold handle pool Nvlist.(pack args Native) with
+    | Ok (Some packed_errors) ->
+        let failures =
+          List.map
+            (fun (name, errno) -> snapshot_failure name errno)
+            (blamed_errors packed_errors names)
+        in
+        skipped := List.rev_append failures !skipped;
+        Ok ()
+    | Ok None -> Ok ()
+    | Error e -> Error e
+  in
+  let failures =
+    List.fold_left
+      (fun failures (pool, names) ->
+        fst (retry_batch issue pool names (( = ) Unix.EEXIST) (failures, [])))
+      [] (group_by_pool snapnames)
+  in
+  List.rev_append failures (List.rev !skipped)
+
+(*
+ * Release the user hold with tag on each of snapnames, one ioctl per pool.
+ * Snapshots not held with tag count as released.
+ *)
+let release_many handle tag snapnames =
+  let issue pool names =
+    let args = Nvlist.alloc () in
+    List.iter
+      (fun name ->
+        let tags = Nvlist.alloc () in
+        Nvlist.add_boolean tags tag;
+        Nvlist.add_nvlist args name tags)
+      names;
+    Ioctls.release handle pool Nvlist.(pack args Native)
+  in
+  List.fold_left
+    (fun failures (pool, names) ->
+      fst (retry_batch issue pool names (( = ) Unix.ESRCH) (failures, [])))
+    [] (group_by_pool snapnames)
+  |> List.rev
+
+(*
+ * Set the same props on many datasets, given as (name, dataset_type,
+ * zoned).  Validation depends only on the dataset type and zoned, so the
+ * props are validated and packed once per combination and the packed
+ * nvlist is shared by all the set_prop ioctls, which run on up to jobs
+ * domains.
+ *
+ * Channel programs can only set user properties.  If props are all user
+ * properties and channel is true, each pool's datasets are instead set by
+ * channel programs of up to channel_batch datasets, falling back to
+ * set_prop if the pool refuses the program.  Returns the datasets that
+ * could not be set with their errors.
+ *)
+let channel_batch = 1000
+
+let set_program =
+  "args = ...\n\
+   errors = {}\n\
+   for ds, _ in pairs(args['datasets']) do\n\
+  \  for prop, value in pairs(args['props']) do\n\
+  \    err = zfs.sync.set_prop(ds, prop, value)\n\
+  \    if err ~= 0 then\n\
+  \      errors[ds] = err\n\
+  \      break\n\
+  \    end\n\
+  \  end\n\
+   end\n\
+   return errors\n"
+
+let set_by_program handle pool names props =
+  let args = Nvlist.alloc () in
+  let arg = Nvlist.alloc () in
+  let datasets = Nvlist.alloc () in
+  List.iter (fun name -> Nvlist.add_boolean_value datasets name true) names;
+  Nvlist.add_nvlist arg "datasets" datasets;
+  Nvlist.add_nvlist arg "props" props;
+  Nvlist.add_string args "program" set_program;
+  Nvlist.add_nvlist args "arg" arg;
+  Nvlist.add_boolean_value args "sync" true;
+  Nvlist.add_uint64 args "instrlimit" 100_000_000L;
+  Nvlist.add_uint64 args "memlimit" 10_485_760L;
+  match
+    Ioctls.channel_program handle pool Nvlist.(pack args Native) 10_485_760L
+  with
+  | Ok packed_result ->
+      let errors =
+        Nvlist.lookup_nvlist (Nvlist.unpack packed_result) "return"
+      in
+      let rec collect errors prev acc =
+        match Nvlist.next_nvpair errors prev with
+        | Some pair ->
+            let name = Nvpair.name pair in
+            let errno =
+              Util.error_of_int @@ Int64.to_int @@ Nvpair.value_int64 pair
+            in
+            let e, why = zfs_standard_error errno in
+            let what = Printf.sprintf "failed to set props for '%s'" name in
+            collect errors (Some pair) ((name, (e, what, why)) :: acc)
+        | None -> List.rev acc
+      in
+      Some
+        (match errors with
+        | Some errors -> collect errors None []
+        | None -> [])
+  | Error _ -> None
+
+let set_many jobs targets props channel =
+  let create = false in
+  let keyok = false in
+  let validated = Hashtbl.create 4 in
+  let packed dataset_type zoned =
+    match Hashtbl.find_opt validated (dataset_type, zoned) with
+    | Some result -> result
+    | None ->
+        let result =
+          Zfs_prop.validate props dataset_type zoned create keyok
+          |> Result.map (fun props -> (props, Nvlist.(pack props Native)))
+        in
+        Hashtbl.replace validated (dataset_type, zoned) result;
+        result
+  in
+  let invalid, valid =
+    List.partition_map
+      (fun (name, dataset_type, zoned) ->
+        match packed dataset_type zoned with
+        | Ok (props, packed_props) -> Either.Right (name, props, packed_props)
+        | Error (e, why) ->
+            let what = Printf.sprintf "failed to set props for '%s'" name in
+            Either.Left (name, (e, what, why)))
+      targets
+  in
+  let userprops props =
+    let rec all prev =
+      match Nvlist.next_nvpair props prev with
+      | Some pair -> String.contains (Nvpair.name pair) ':' && all (Some pair)
+      | None -> true
+    in
+    all None
+  in
+  let by_program, fallback =
+    match valid with
+    | (_, props, _) :: _ when channel && userprops props ->
+        let handle = Ioctls.open_handle () in
+        let batches =
+          group_by_pool (List.map (fun (name, _, _) -> name) valid)
+          |> List.concat_map (fun (pool, names) ->
+                 List.map (fun batch -> (pool, batch))
+                 @@ chunk channel_batch names)
+        in
+        let failures, fallback =
+          List.fold_left
+            (fun (failures, fallback) (pool, batch) ->
+              match set_by_program handle pool batch props with
+              | Some errors -> (errors :: failures, fallback)
+              | None -> (failures, batch :: fallback))
+            ([], []) batches
+        in
+        (List.concat (List.rev failures), List.concat (List.rev fallback))
+    | _ -> ([], List.map (fun (name, _, _) -> name) valid)
+  in
+  let packed = Hashtbl.create (List.length valid) in
+  List.iter
+    (fun (name, _, packed_props) -> Hashtbl.replace packed name packed_props)
+    valid;
+  let by_ioctl =
+    List.map (fun name -> (name, Hashtbl.find packed name)) fallback
+  in
+  let results =
+    Parallel.map jobs
+      (fun handle (name, packed_props) ->
+        Result.map_error
+          (fun error -> (name, error))
+          (set_packed handle name packed_props))
+      (Array.of_list by_ioctl)
+  in
+  invalid @ by_program
+  @ List.filter_map
+      (function Ok () -> None | Error failure -> Some failure)
+      (Array.to_list results)
+
 let destroy handle name =
   match
     (* NB: to defer use destroy_snaps *)
@@ -262,7 +960,388 @@ let rename handle oldname newname flags =
       let what = Printf.sprintf "cannot rename '%s'" failed in
       Error (e, what, why)
 
-(* TODO: send/recv *)
+let receive_resume_token handle name =
+  match stats handle name with
+  | Ok (_stats, props) -> (
+      match
+        Nvlist.lookup_nvlist props Zfs_prop.(to_string Receive_resume_token)
+      with
+      | Some prop -> Ok (Nvlist.lookup_string prop "value")
+      | None -> Ok None)
+  | Error e -> Error e
+
+(* The user holds on a snapshot as (tag, time the hold was taken). *)
+let get_holds handle snapname =
+  match
+    Ioctls.get_holds handle snapname |> Result.map_error zfs_standard_error
+  with
+  | Ok packed_holds ->
+      let holds = Nvlist.unpack packed_holds in
+      let rec collect prev acc =
+        match Nvlist.next_nvpair holds prev with
+        | Some pair ->
+            let tag = Nvpair.name pair in
+            let time = Nvpair.value_uint64 pair in
+            collect (Some pair) ((tag, time) :: acc)
+        | None -> List.rev acc
+      in
+      Ok (collect None [])
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot get holds for '%s'" snapname in
+      Error (e, what, why)
+
+let get_bookmarks handle name propsopt =
+  match
+    let packed_props_opt =
+      Option.map
+        (fun propnames ->
+          let props = Nvlist.alloc () in
+          Array.iter (Nvlist.add_boolean props) propnames;
+          Nvlist.(pack props Native))
+        propsopt
+    in
+    Ioctls.get_bookmarks handle name packed_props_opt
+    |> Result.map_error zfs_standard_error
+  with
+  | Ok packed_bookmarks -> Ok (Nvlist.unpack packed_bookmarks)
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot get bookmarks for '%s'" name in
+      Error (e, what, why)
+
+let get_bookmark_props handle name =
+  match
+    Ioctls.get_bookmark_props handle name |> Result.map_error zfs_standard_error
+  with
+  | Ok packed_props -> Ok (Nvlist.unpack packed_props)
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot get properties for '%s'" name in
+      Error (e, what, why)
+
+(* The guid of a snapshot or of a bookmark ("fs#bookmark"). *)
+let guid handle name =
+  let ( let* ) = Result.bind in
+  if String.contains name '#' then
+    let* props = get_bookmark_props handle name in
+    match
+      Option.bind (Nvlist.lookup_nvlist props "guid") (fun prop ->
+          Nvlist.lookup_uint64 prop "value")
+    with
+    | Some guid -> Ok guid
+    | None -> failwith "get_bookmark_props failed to return guid"
+  else
+    let* stats = stats_simple handle name in
+    Ok stats.Types.guid
+
+(*
+ * Find the snapshot or bookmark of a filesystem with the given guid, as
+ * needed to name the incremental source of a resumed send.
+ *)
+let find_guid handle fsname guid =
+  let ( let* ) = Result.bind in
+  let rec iter_snapshots cookie =
+    let* next = snapshot_list_next_simple handle fsname cookie in
+    match next with
+    | Some (snapname, stats, next_cookie) ->
+        if Int64.equal stats.Types.guid guid then Ok (Some snapname)
+        else iter_snapshots next_cookie
+    | None -> Ok None
+  in
+  let* snapopt = iter_snapshots 0L in
+  if Option.is_some snapopt then Ok snapopt
+  else
+    let* bookmarks = get_bookmarks handle fsname (Some [| "guid" |]) in
+    let rec iter_bookmarks prev =
+      match Nvlist.next_nvpair bookmarks prev with
+      | Some pair -> (
+          let bmark = Nvpair.name pair in
+          let bmark_guid =
+            Option.bind (Nvlist.lookup_nvlist bookmarks bmark) (fun props ->
+                Option.bind (Nvlist.lookup_nvlist props "guid") (fun prop ->
+                    Nvlist.lookup_uint64 prop "value"))
+          in
+          match bmark_guid with
+          | Some g when Int64.equal g guid ->
+              Some (Printf.sprintf "%s#%s" fsname bmark)
+          | _ -> iter_bookmarks (Some pair))
+      | None -> None
+    in
+    Ok (iter_bookmarks None)
+
+(*
+ * Snapshots and bookmarks of a filesystem indexed by guid, so that matching
+ * the snapshots of a source and a target costs one hash lookup per snapshot
+ * instead of one listing per snapshot.
+ *)
+type guid_index = {
+  snapshots : (string * Types.objset_stats) array; (* oldest first *)
+  snapshot_guids : (int64, int) Hashtbl.t; (* guid -> index in snapshots *)
+  bookmark_guids : (int64, string * int64) Hashtbl.t; (* guid -> name, txg *)
+}
+
+type incremental_base = BaseSnapshot of string | BaseBookmark of string
+
+type incremental_plan = {
+  base : incremental_base option;
+  chain : (string option * string) list; (* (fromsnap, tosnap), in order *)
+}
+
+let guid_index handle fsname =
+  let ( let* ) = Result.bind in
+  let* snapshots = list_snapshots handle fsname in
+  let snapshots = Array.of_list snapshots in
+  let snapshot_guids = Hashtbl.create (Array.length snapshots) in
+  Array.iteri
+    (fun i (_, stats) -> Hashtbl.replace snapshot_guids stats.Types.guid i)
+    snapshots;
+  let* bookmarks =
+    get_bookmarks handle fsname (Some [| "guid"; "createtxg" |])
+  in
+  let bookmark_guids = Hashtbl.create 16 in
+  let rec iter_bookmarks prev =
+    match Nvlist.next_nvpair bookmarks prev with
+    | Some pair ->
+        let bmark = Nvpair.name pair in
+        (match Nvlist.lookup_nvlist bookmarks bmark with
+        | Some props -> (
+            match (uint64_prop props "guid", uint64_prop props "createtxg") with
+            | Some guid, Some txg ->
+                let name = Printf.sprintf "%s#%s" fsname bmark in
+                Hashtbl.replace bookmark_guids guid (name, txg)
+            | _ -> ())
+        | None -> ());
+        iter_bookmarks (Some pair)
+    | None -> ()
+  in
+  iter_bookmarks None;
+  Ok { snapshots; snapshot_guids; bookmark_guids }
+
+(* A target that does not exist yet has an empty index. *)
+let guid_index_opt handle fsname =
+  match guid_index handle fsname with
+  | Ok index -> Ok index
+  | Error (EzfsNoEnt, _, _) ->
+      Ok
+        {
+          snapshots = [||];
+          snapshot_guids = Hashtbl.create 0;
+          bookmark_guids = Hashtbl.create 0;
+        }
+  | Error e -> Error e
+
+let incremental_base_name = function
+  | BaseSnapshot name | BaseBookmark name -> name
+
+let base_of_guid index guid =
+  match Hashtbl.find_opt index.snapshot_guids guid with
+  | Some i -> Some (BaseSnapshot (fst index.snapshots.(i)))
+  | None ->
+      Hashtbl.find_opt index.bookmark_guids guid
+      |> Option.map (fun (name, _txg) -> BaseBookmark name)
+
+(*
+ * Find the newest source snapshot or bookmark that also exists as a snapshot
+ * on the target, and the chain of incrementals from there to the newest
+ * source snapshot.  A bookmark is only chosen when it is newer than every
+ * common snapshot, i.e. when the source snapshot it was created from has
+ * since been destroyed.  Without a common base the chain starts with a full
+ * send of the oldest source snapshot.
+ *)
+let plan_incremental source target =
+  let nsnaps = Array.length source.snapshots in
+  let txg i = (snd source.snapshots.(i)).Types.creation_txg in
+  let rec newest_common i =
+    if i < 0 then None
+    else
+      let snapname, stats = source.snapshots.(i) in
+      if Hashtbl.mem target.snapshot_guids stats.Types.guid then
+        Some (BaseSnapshot snapname, stats.Types.creation_txg)
+      else newest_common (i - 1)
+  in
+  let base =
+    Hashtbl.fold
+      (fun guid (bmark, bmark_txg) base ->
+        if not (Hashtbl.mem target.snapshot_guids guid) then base
+        else
+          match base with
+          | Some (_, base_txg)
+            when Int64.unsigned_compare bmark_txg base_txg <= 0 ->
+              base
+          | _ -> Some (BaseBookmark bmark, bmark_txg))
+      source.bookmark_guids
+      (newest_common (nsnaps - 1))
+  in
+  let incrementals first =
+    List.init (max 0 (nsnaps - first)) (fun k ->
+        let i = first + k in
+        let fromsnap =
+          if i = 0 then None else Some (fst source.snapshots.(i - 1))
+        in
+        (fromsnap, fst source.snapshots.(i)))
+  in
+  match base with
+  | None -> { base = None; chain = incrementals 0 }
+  | Some (base, base_txg) ->
+      let rec first_after i =
+        if i < nsnaps && Int64.unsigned_compare (txg i) base_txg <= 0 then
+          first_after (i + 1)
+        else i
+      in
+      let first = first_after 0 in
+      let chain =
+        match incrementals first with
+        | (_, tosnap) :: rest ->
+            (Some (incremental_base_name base), tosnap) :: rest
+        | [] -> []
+      in
+      { base = Some base; chain }
+
+let add_send_flags args flags =
+  Array.iter
+    (fun flag ->
+      Nvlist.add_boolean args
+      @@
+      match flag with
+      | Types.LzcSendFlagEmbedData -> "embedok"
+      | Types.LzcSendFlagLargeBlock -> "largeblockok"
+      | Types.LzcSendFlagCompress -> "compressok"
+      | Types.LzcSendFlagRaw -> "rawok"
+      | Types.LzcSendFlagSaved -> "savedok")
+    flags
+
+let send_args fd fromopt flags =
+  let args = Nvlist.alloc () in
+  Nvlist.add_int32 args "fd" @@ Int32.of_int @@ Util.int_of_descr fd;
+  Option.iter (Nvlist.add_string args "fromsnap") fromopt;
+  add_send_flags args flags;
+  args
+
+let send_error = function
+  | Unix.EXDEV | Unix.ENOENT | Unix.ESRCH ->
+      ( EzfsNoEnt,
+        "incremental source does not exist or is not an earlier snapshot of \
+         the same filesystem" )
+  | Unix.EACCES -> (EzfsCryptoFailed, "dataset key must be loaded")
+  | errno -> zfs_standard_error errno
+
+let send handle tosnap fromopt fd flags =
+  match
+    let args = send_args fd fromopt flags in
+    let packed_args = Nvlist.(pack args Native) in
+    Ioctls.send_new handle tosnap packed_args |> Result.map_error send_error
+  with
+  | Ok () -> Ok ()
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot send '%s'" tosnap in
+      Error (e, what, why)
+
+let send_space handle tosnap fromopt flags =
+  match
+    let args = Nvlist.alloc () in
+    Option.iter (Nvlist.add_string args "from") fromopt;
+    add_send_flags args flags;
+    let packed_args = Nvlist.(pack args Native) in
+    Ioctls.send_space handle tosnap (Some packed_args)
+    |> Result.map_error send_error
+  with
+  | Ok packed_result ->
+      let result = Nvlist.unpack packed_result in
+      Ok (Option.get @@ Nvlist.lookup_uint64 result "space")
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot estimate space for '%s'" tosnap in
+      Error (e, what, why)
+
+let send_resume handle token fd =
+  let ( let* ) = Result.bind in
+  match
+    let* (resume : Resume_token.t) =
+      Resume_token.decode token
+      |> Result.map_error (fun why -> (EzfsFault, why))
+    in
+    let fsname = List.hd @@ String.split_on_char '@' resume.toname in
+    let* (tostats : Types.objset_stats) =
+      stats_simple handle resume.toname
+      |> Result.map_error (fun (e, _what, why) -> (e, why))
+    in
+    let* () =
+      if not (Int64.equal tostats.guid resume.toguid) then
+        Error
+          ( EzfsBadBackup,
+            Printf.sprintf
+              "'%s' is no longer the same snapshot used in the initial send"
+              resume.toname )
+      else Ok ()
+    in
+    let* fromopt =
+      match resume.fromguid with
+      | Some fromguid -> (
+          match find_guid handle fsname fromguid with
+          | Ok (Some fromname) -> Ok (Some fromname)
+          | Ok None ->
+              Error
+                ( EzfsBadBackup,
+                  Printf.sprintf "incremental source %#Lx no longer exists"
+                    fromguid )
+          | Error (e, _what, why) -> Error (e, why))
+      | None -> Ok None
+    in
+    let args = send_args fd fromopt resume.flags in
+    Nvlist.add_uint64 args "resume_object" resume.obj;
+    Nvlist.add_uint64 args "resume_offset" resume.offset;
+    let packed_args = Nvlist.(pack args Native) in
+    Ioctls.send_new handle resume.toname packed_args
+    |> Result.map_error send_error
+  with
+  | Ok () -> Ok ()
+  | Error (e, why) ->
+      let what = "cannot resume send" in
+      Error (e, what, why)
+
+let receive handle snapname originopt fd force resumable =
+  let ( let* ) = Result.bind in
+  match
+    (* The kernel expects the BEGIN record to be read for it. *)
+    let drr_size = Send_stream.drr_size in
+    let begin_record = Bytes.create drr_size in
+    let rec read_begin_record offset =
+      if offset = drr_size then Ok ()
+      else
+        match Unix.read fd begin_record offset (drr_size - offset) with
+        | 0 -> Error (EzfsBadStream, "stream is truncated")
+        | n -> read_begin_record (offset + n)
+        | exception Unix.Unix_error (errno, _, _) ->
+            Error (zfs_standard_error errno)
+    in
+    let* () = read_begin_record 0 in
+    let fsname = List.hd @@ String.split_on_char '@' snapname in
+    match
+      Ioctls.recv handle fsname None None snapname originopt fd begin_record
+        force resumable
+    with
+    | Ok (read_bytes, _errflags, _packed_errors) -> Ok read_bytes
+    | Error Unix.EEXIST -> Error (EzfsExists, "destination already exists")
+    | Error Unix.ETXTBSY ->
+        Error
+          ( EzfsBadRestore,
+            "destination has been modified since most recent snapshot" )
+    | Error Unix.ENODEV ->
+        Error
+          ( EzfsBadStream,
+            "most recent snapshot of destination does not match incremental \
+             source" )
+    | Error Unix.EINVAL -> Error (EzfsBadStream, to_string EzfsBadStream)
+    | Error errno -> Error (zfs_standard_error errno)
+  with
+  | Ok read_bytes -> Ok read_bytes
+  | Error (e, why) ->
+      let what = Printf.sprintf "cannot receive '%s'" snapname in
+      Error (e, what, why)
+
+(* Stream the changes between two snapshots, see Diff.iter. *)
+let diff resolver fromsnap tosnap mountopt f =
+  Diff.iter resolver fromsnap tosnap mountopt f
+
+(* Walk the allocated objects of a dataset, see Objects.iter. *)
+let objects jobs stats dataset f = Objects.iter jobs stats dataset f
 
 let promote handle name =
   match
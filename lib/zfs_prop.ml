@@ -222,7 +222,7 @@ type attributes = {
   index_table : (string * int64) array;
 }
 
-let attributes =
+let make_attributes =
   let empty_index_table = [||] in
   let boolean_values = Some "on | off" in
   let boolean_index_table = [| ("off", 0L); ("on", 1L) |] in
@@ -2160,15 +2160,124 @@ let attributes =
         index_table = boolean_index_table;
       }
 
-let to_string prop = (attributes prop).name
+external int_of_t : t -> int = "caml_zfs_util_int_of_t"
+
+(* Every constructor in declaration order, so all_props.(int_of_t p) = p. *)
+let all_props =
+  [|
+    Aclinherit;
+    Aclmode;
+    Acltype;
+    Atime;
+    Available;
+    Canmount;
+    Case;
+    Checksum;
+    Clones;
+    Compression;
+    Compressratio;
+    Copies;
+    Createtxg;
+    Creation;
+    Dedup;
+    Defer_destroy;
+    Devices;
+    Dnodesize;
+    Encryption;
+    Encryption_root;
+    Exec;
+    Filesystem_count;
+    Filesystem_limit;
+    Guid;
+    Inconsistent;
+    Inval;
+    Iscsioptions;
+    Ivset_guid;
+    Key_guid;
+    Keyformat;
+    Keylocation;
+    Keystatus;
+    Logbias;
+    Logicalreferenced;
+    Logicalused;
+    Mlslabel;
+    Mounted;
+    Mountpoint;
+    Name;
+    Nbmand;
+    Normalize;
+    Numclones;
+    Objsetid;
+    Origin;
+    Overlay;
+    Pbkdf2_iters;
+    Pbkdf2_salt;
+    Prefetch;
+    Prev_snap;
+    Primarycache;
+    Quota;
+    Readonly;
+    Receive_resume_token;
+    Recordsize;
+    Redact_snaps;
+    Redacted;
+    Redundant_metadata;
+    Referenced;
+    Refquota;
+    Refratio;
+    Refreservation;
+    Relatime;
+    Remaptxg;
+    Reservation;
+    Secondarycache;
+    Selinux_context;
+    Selinux_defcontext;
+    Selinux_fscontext;
+    Selinux_rootcontext;
+    Setuid;
+    Sharenfs;
+    Sharesmb;
+    Snapdev;
+    Snapdir;
+    Snapshot_count;
+    Snapshot_limit;
+    Snapshots_changed;
+    Special_small_blocks;
+    Stmf_shareinfo;
+    Sync;
+    Type;
+    Unique;
+    Used;
+    Usedchild;
+    Usedds;
+    Usedrefreserv;
+    Usedsnap;
+    Useraccounting;
+    Userprop;
+    Userrefs;
+    Utf8only;
+    Version;
+    Volblocksize;
+    Volmode;
+    Volsize;
+    Volthreading;
+    Vscan;
+    Written;
+    Xattr;
+    Zoned;
+  |]
 
-let string_to_index prop str =
-  (attributes prop).index_table
-  |> Array.find_map (fun (s, i) -> if s = str then Some i else None)
+(* Inval and Userprop have no attributes. *)
+let table =
+  Prop_table.create all_props
+    (function Inval | Userprop -> None | prop -> Some (make_attributes prop))
+    (fun attributes -> attributes.index_table)
 
-let index_to_string prop idx =
-  (attributes prop).index_table
-  |> Array.find_map (fun (s, i) -> if i = idx then Some s else None)
+let entry prop = Prop_table.find table (int_of_t prop)
+let attributes prop = (entry prop).attributes
+let to_string prop = (attributes prop).name
+let string_to_index prop str = Prop_table.string_to_index (entry prop) str
+let index_to_string prop idx = Prop_table.index_to_string (entry prop) idx
 
 let is_encryption_key_param = function
   (* properties that require a loaded encryption key to modify *)
@@ -2180,121 +2289,131 @@ type checked_value =
   | Uint64 of int64
   | Uint64_array of int64 array
 
-let validate nvl dataset_type zoned create keyok =
+(* Why a property can or cannot be set in a context, before its value. *)
+type admission = Admitted | Not_applicable | Readonly | Create_only
+
+let admission dataset_type create keyok prop attrs =
+  if not (Array.mem dataset_type attrs.dataset_types) then Not_applicable
+  else if attrs.readonly || (is_encryption_key_param prop && not keyok) then
+    Readonly
+  else if (not create) && attrs.onetime then Create_only
+  else Admitted
+
+(*
+ * Given an nvpair as property=value, check that the name and value are
+ * acceptable to pass on to the kernel.  If the property is index typed,
+ * decode the string value to its index.  If the property is number typed,
+ * the value may be specified as a string with optional units.  The property
+ * name and value are returned on success, otherwise an error type and reason.
+ *)
+let check_pair admit dataset_type zoned pair =
   let open Error in
   let open Nvpair in
   let ( let* ) = Result.bind in
-  (*
-   * Given an nvpair from nvl as property=value, check that the name and value
-   * are acceptable to pass on to the kernel.  If the property is index typed,
-   * decode the string value to its index.  If the property is number typed,
-   * the value may be specified as a string with optional units.  The property
-   * name and value are returned on success, otherwise an error type and reason.
-   *)
-  let check pair =
-    let propname = Nvpair.name pair in
-    let prop = of_string propname in
-    if prop = Inval then
-      (* Not a zfs property, check if it is a userprop. *)
-      if String.contains propname ':' then
-        (* Validate as a userprop. *)
-        if Nvpair.data_type pair != String then
-          Error (EzfsBadProp, Printf.sprintf "'%s' must be a string" propname)
-        else if String.length propname >= Const.max_name_len then
-          Error
-            ( EzfsBadProp,
-              Printf.sprintf "property name '%s' is too long" propname )
-        else
-          let strval = Nvpair.value_string pair in
-          if String.length strval >= Const.max_prop_len then
-            Error
-              ( EzfsBadProp,
-                Printf.sprintf "property value '%s' is too long" strval )
-          else (* Acceptable userprop. *)
-            Ok (propname, String strval)
-      else if dataset_type = Snapshot then
+  let propname = Nvpair.name pair in
+  let prop = of_string propname in
+  if prop = Inval then
+    (* Not a zfs property, check if it is a userprop. *)
+    if String.contains propname ':' then
+      (* Validate as a userprop. *)
+      if Nvpair.data_type pair != String then
+        Error (EzfsBadProp, Printf.sprintf "'%s' must be a string" propname)
+      else if String.length propname >= Const.max_name_len then
         Error
-          ( EzfsPropType,
-            Printf.sprintf "'%s' cannot be modified for snapshots" propname )
+          ( EzfsBadProp,
+            Printf.sprintf "property name '%s' is too long" propname )
       else
-        (* Not a userprop, check if a userquota prop. *)
-        match Userquota_prop.decode_propname propname zoned with
-        | Some (quotaprop, rid) -> (
-            let domain =
-              ""
-              (* TODO: IDMAP support in decode_propname *)
-            in
-            match quotaprop with
-            | Userquota | Userobjquota | Groupquota | Groupobjquota
-            | Projectquota | Projectobjquota ->
-                (* Valid userquota prop, check the value. *)
-                let* intval =
-                  match Nvpair.data_type pair with
-                  | String -> (
-                      let strval = Nvpair.value_string pair in
-                      if strval = "none" then Ok 0L
-                      else
-                        match Util.nicestrtonum strval with
-                        | Ok intval -> Ok intval
-                        | Error msg -> Error (EzfsBadProp, msg))
-                  | Uint64 ->
-                      let intval = Nvpair.value_uint64 pair in
-                      if intval = 0L then
-                        Error
-                          ( EzfsBadProp,
-                            "use 'none' to disable {user|group|project} quota"
-                          )
-                      else Ok intval
-                  | _ ->
+        let strval = Nvpair.value_string pair in
+        if String.length strval >= Const.max_prop_len then
+          Error
+            ( EzfsBadProp,
+              Printf.sprintf "property value '%s' is too long" strval )
+        else (* Acceptable userprop. *)
+          Ok (propname, String strval)
+    else if dataset_type = Snapshot then
+      Error
+        ( EzfsPropType,
+          Printf.sprintf "'%s' cannot be modified for snapshots" propname )
+    else
+      (* Not a userprop, check if a userquota prop. *)
+      match Userquota_prop.decode_propname propname zoned with
+      | Some (quotaprop, rid) -> (
+          let domain =
+            ""
+            (* TODO: IDMAP support in decode_propname *)
+          in
+          match quotaprop with
+          | Userquota | Userobjquota | Groupquota | Groupobjquota
+          | Projectquota | Projectobjquota ->
+              (* Valid userquota prop, check the value. *)
+              let* intval =
+                match Nvpair.data_type pair with
+                | String -> (
+                    let strval = Nvpair.value_string pair in
+                    if strval = "none" then Ok 0L
+                    else
+                      match Util.nicestrtonum strval with
+                      | Ok intval -> Ok intval
+                      | Error msg -> Error (EzfsBadProp, msg))
+                | Uint64 ->
+                    let intval = Nvpair.value_uint64 pair in
+                    if intval = 0L then
                       Error
                         ( EzfsBadProp,
-                          Printf.sprintf "'%s' must be a number" propname )
-                in
-                (* Valid value, encode the name and value for the nvlist. *)
-                let encoded_propname =
-                  Userquota_prop.encode_propname quotaprop rid domain
-                in
-                let encoded_propval =
-                  Userquota_prop.encode_propval quotaprop rid intval
-                in
-                Ok (encoded_propname, Uint64_array encoded_propval)
-            | _ ->
-                (* Readonly userquota prop. *)
-                Error
-                  (EzfsPropReadonly, Printf.sprintf "'%s' is readonly" propname)
-            )
-        | None ->
-            (* Not a userquota prop, check if a written prop. *)
-            if
-              String.starts_with ~prefix:"written@" propname
-              || String.starts_with ~prefix:"written#" propname
-            then
+                          "use 'none' to disable {user|group|project} quota"
+                        )
+                    else Ok intval
+                | _ ->
+                    Error
+                      ( EzfsBadProp,
+                        Printf.sprintf "'%s' must be a number" propname )
+              in
+              (* Valid value, encode the name and value for the nvlist. *)
+              let encoded_propname =
+                Userquota_prop.encode_propname quotaprop rid domain
+              in
+              let encoded_propval =
+                Userquota_prop.encode_propval quotaprop rid intval
+              in
+              Ok (encoded_propname, Uint64_array encoded_propval)
+          | _ ->
+              (* Readonly userquota prop. *)
               Error
                 (EzfsPropReadonly, Printf.sprintf "'%s' is readonly" propname)
-            else
-              (* Not a written prop either. *)
-              Error
-                (EzfsBadProp, Printf.sprintf "invalid property '%s'" propname)
-    else
-      (* We have a supported zfs property. *)
-      let attrs = attributes prop in
-      if not (Array.mem dataset_type attrs.dataset_types) then
+          )
+      | None ->
+          (* Not a userquota prop, check if a written prop. *)
+          if
+            String.starts_with ~prefix:"written@" propname
+            || String.starts_with ~prefix:"written#" propname
+          then
+            Error
+              (EzfsPropReadonly, Printf.sprintf "'%s' is readonly" propname)
+          else
+            (* Not a written prop either. *)
+            Error
+              (EzfsBadProp, Printf.sprintf "invalid property '%s'" propname)
+  else
+    (* We have a supported zfs property. *)
+    let attrs = attributes prop in
+    match admit prop attrs with
+    | Not_applicable ->
         Error
           ( EzfsBadProp,
             Printf.sprintf "'%s' does not apply to datasets of this type"
               propname )
-      else if attrs.readonly || not (is_encryption_key_param prop && keyok) then
+    | Readonly ->
         Error (EzfsPropReadonly, Printf.sprintf "'%s' is readonly" propname)
-      else if (not create) && attrs.onetime then
+    | Create_only ->
         Error
           ( EzfsBadProp,
             Printf.sprintf "property '%s' can only be set at creation time"
               propname )
-      else
+    | Admitted ->
         (*
          * Parse the value of a pair into the correct type for the property.
-         * Index properties decode the string value into its index.  Number values
-         * given as strings are parsed and units if given are applied.
+         * Index properties decode the string value into its index.  Number
+         * values given as strings are parsed and units if given are applied.
          *)
         match
           let datatype = Nvpair.data_type pair in
@@ -2306,7 +2425,8 @@ let validate nvl dataset_type zoned create keyok =
               else
                 let strval = Nvpair.value_string pair in
                 if String.length strval > Const.max_prop_len then
-                  Error (EzfsBadProp, Printf.sprintf "'%s' is too long" propname)
+                  Error
+                    (EzfsBadProp, Printf.sprintf "'%s' is too long" propname)
                 else Ok (String strval)
           | Index -> (
               if datatype != String then
@@ -2363,14 +2483,14 @@ let validate nvl dataset_type zoned create keyok =
                       ( EzfsBadProp,
                         Printf.sprintf "component of '%s' is too long" propname
                       )
-                  else if zoned && Util.getzoneid () = 0 then
+                  else if zoned && Util.zoneid () = 0 then
                     Error
                       ( EzfsZoned,
                         Printf.sprintf
                           "'%s' cannot be set while dataset 'zoned' property \
                            is set"
                           propname )
-                  else if (not zoned) && Util.getzoneid () != 0 then
+                  else if (not zoned) && Util.zoneid () != 0 then
                     Error
                       ( EzfsZoned,
                         Printf.sprintf
@@ -2378,14 +2498,14 @@ let validate nvl dataset_type zoned create keyok =
                           propname )
                   else Ok ()
               | Sharesmb | Sharenfs ->
-                  if zoned && Util.getzoneid () = 0 then
+                  if zoned && Util.zoneid () = 0 then
                     Error
                       ( EzfsZoned,
                         Printf.sprintf
                           "'%s' cannot be set while dataset 'zoned' property \
                            is set"
                           propname )
-                  else if (not zoned) && Util.getzoneid () != 0 then
+                  else if (not zoned) && Util.zoneid () != 0 then
                     Error
                       ( EzfsZoned,
                         Printf.sprintf
@@ -2468,10 +2588,13 @@ let validate nvl dataset_type zoned create keyok =
             Ok (propname, Uint64 intval)
         | Ok (Uint64_array intvals) -> Ok (propname, Uint64_array intvals)
         | Error e -> Error e
-  in
-  (*
-   * Build up an nvlist that can be passed to the kernel.
-   *)
+
+(*
+ * Build up an nvlist that can be passed to the kernel from the checked pairs
+ * of nvl.
+ *)
+let check_nvlist check nvl =
+  let open Nvpair in
   let result = Nvlist.alloc () in
   let accept = function
     | propname, String strval -> Nvlist.add_string result propname strval
@@ -2491,49 +2614,174 @@ let validate nvl dataset_type zoned create keyok =
   in
   iter_pairs None
 
-let validate_name name dstypes modifying =
-  if (not (Array.mem Snapshot dstypes)) && String.contains name '@' then
+let validate nvl dataset_type zoned create keyok =
+  let admit = admission dataset_type create keyok in
+  check_nvlist (check_pair admit dataset_type zoned) nvl
+
+(*
+ * A validation plan for property sets bound for datasets of one type, set
+ * with one zoned, create and keyok context.  Whether each property may be
+ * set at all is decided when the plan is compiled, and the outcome of
+ * checking each (property, value) pair is remembered, so validating many
+ * near-identical sets parses every value once.  Names with an '@' are
+ * never remembered, as userquota names resolve through the name service.
+ *)
+type plan = {
+  plan_type : dataset_type;
+  plan_zoned : bool;
+  admissions : admission array; (* by constructor *)
+  checked :
+    ( string * checked_value,
+      (string * checked_value, Error.zfs_error * string) result )
+    Lru.t;
+}
+
+let plan_cache_size = 4096
+let plan_max_value_len = 256 (* longer values are checked every time *)
+
+let compile dataset_type zoned create keyok =
+  let admissions =
+    Array.map
+      (function
+        | Inval | Userprop -> Not_applicable
+        | prop -> admission dataset_type create keyok prop (attributes prop))
+      all_props
+  in
+  {
+    plan_type = dataset_type;
+    plan_zoned = zoned;
+    admissions;
+    checked = Lru.create plan_cache_size;
+  }
+
+let check_planned plan pair =
+  let open Nvpair in
+  let admit prop _attrs = plan.admissions.(int_of_t prop) in
+  let check () = check_pair admit plan.plan_type plan.plan_zoned pair in
+  let propname = Nvpair.name pair in
+  let value =
+    if String.contains propname '@' then None
+    else
+      match Nvpair.data_type pair with
+      | String ->
+          let strval = Nvpair.value_string pair in
+          if String.length strval > plan_max_value_len then None
+          else Some (String strval)
+      | Uint64 -> Some (Uint64 (Nvpair.value_uint64 pair))
+      | _ -> None
+  in
+  match value with
+  | Some value -> (
+      match Lru.find_opt plan.checked (propname, value) with
+      | Some result -> result
+      | None ->
+          let result = check () in
+          Lru.add plan.checked (propname, value) result;
+          result)
+  | None -> check ()
+
+(* Like validate, in the context plan was compiled for. *)
+let validate_planned plan nvl = check_nvlist (check_planned plan) nvl
+
+(* Hits and misses of the value cache of plan. *)
+let plan_stats plan = Lru.stats plan.checked
+
+(*
+ * Classes of the characters of dataset names, indexed by character code, so
+ * that a name is validated in a single pass doing one lookup per character.
+ *)
+let name_invalid = 0
+let name_plain = 1
+let name_dot = 2
+let name_slash = 3
+let name_at = 4
+let name_hash = 5
+let name_percent = 6
+
+let name_classes =
+  String.init 256 (fun code ->
+      Char.chr
+        (match Char.chr code with
+        | 'a' .. 'z' | 'A' .. 'Z' | '0' .. '9' | '-' | '_' | ':' | ' ' ->
+            name_plain
+        | '.' -> name_dot
+        | '/' -> name_slash
+        | '@' -> name_at
+        | '#' -> name_hash
+        | '%' -> name_percent
+        | _ -> name_invalid))
+
+let check_name snapshot bookmark modifying name =
+  let len = String.length name in
+  let ats = ref 0 and hashes = ref 0 and percent = ref false in
+  (* The first error found in a component, in order. *)
+  let error = ref None in
+  let fail why = if Option.is_none !error then error := Some why in
+  (* Components are the runs between delimiters; start is where the current
+     one began and dots counts its dots. *)
+  let start = ref 0 and dots = ref 0 in
+  let end_component i =
+    let n = i - !start in
+    if n = 0 then
+      fail "empty component or misplaced '@' or '#' delimiter in name"
+    else if n = 1 && !dots = 1 then fail "self reference, '.' is found in name"
+    else if n = 2 && !dots = 2 then
+      fail "parent reference, '..' is found in name";
+    start := i + 1;
+    dots := 0
+  in
+  for i = 0 to len - 1 do
+    let c = String.unsafe_get name i in
+    let cls = Char.code (String.unsafe_get name_classes (Char.code c)) in
+    if cls = name_plain then ()
+    else if cls = name_dot then incr dots
+    else if cls = name_slash then end_component i
+    else if cls = name_at then (
+      incr ats;
+      end_component i)
+    else if cls = name_hash then (
+      incr hashes;
+      end_component i)
+    else if cls = name_percent then percent := true
+    else if Option.is_none !error then
+      error := Some (Printf.sprintf "invalid character '%c' in name" c)
+  done;
+  if len > 0 then end_component len;
+  if (not snapshot) && !ats > 0 then
     Error "snapshot delimiter '@' is not expected here"
-  else if Array.mem Snapshot dstypes && not (String.contains name '@') then
+  else if snapshot && !ats = 0 then
     Error "missing '@' delimiter in snapshot name"
-  else if (not (Array.mem Bookmark dstypes)) && String.contains name '#' then
+  else if (not bookmark) && !hashes > 0 then
     Error "bookmark delimiter '#' is not expected here"
-  else if Array.mem Bookmark dstypes && not (String.contains name '#') then
+  else if bookmark && !hashes = 0 then
     Error "missing '#' delimiter in bookmark name"
-  else if modifying && String.contains name '%' then
-    Error "invalid character '%' in name"
-  else if String.length name >= Const.max_name_len then Error "name is too long"
-  else if String.starts_with ~prefix:"/" name then Error "leading slash in name"
-  else if String.ends_with ~suffix:"/" name then Error "trailing slash in name"
+  else if modifying && !percent then Error "invalid character '%' in name"
+  else if len >= Const.max_name_len then Error "name is too long"
+  else if len > 0 && name.[0] = '/' then Error "leading slash in name"
+  else if len > 0 && name.[len - 1] = '/' then Error "trailing slash in name"
   else
-    match
-      Str.split_delim (Str.regexp "[/@#]") name
-      |> List.find_map (function
-           | "" ->
-               Some "empty component or misplaced '@' or '#' delimiter in name"
-           | "." -> Some "self reference, '.' is found in name"
-           | ".." -> Some "parent reference, '..' is found in name"
-           | component ->
-               String.to_seq component
-               |> Seq.find_map (fun c ->
-                      let valid_chars =
-                        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.: \
-                         %"
-                      in
-                      if String.contains valid_chars c then None
-                      else
-                        Some (Printf.sprintf "invalid character '%c' in name" c)))
-    with
-    | Some errmsg -> Error errmsg
+    match !error with
+    | Some why -> Error why
     | None ->
-        let ndelim =
-          String.fold_left
-            (fun count c -> count + if String.contains "@#" c then 1 else 0)
-            0 name
-        in
-        if ndelim > 1 then Error "multiple '@' and/or '#' delimiters in name"
+        if !ats + !hashes > 1 then
+          Error "multiple '@' and/or '#' delimiters in name"
         else Ok ()
 
+let validate_name name dstypes modifying =
+  check_name
+    (Array.mem Snapshot dstypes)
+    (Array.mem Bookmark dstypes)
+    modifying name
+
+(* validate_name for each of names, sharing the decoding of dstypes. *)
+let validate_names names dstypes modifying =
+  Array.map
+    (check_name
+       (Array.mem Snapshot dstypes)
+       (Array.mem Bookmark dstypes)
+       modifying)
+    names
+
 let has_encryption_props nvl =
   let open Nvpair in
   (match Nvlist.lookup_uint64 nvl (to_string Encryption) with
@@ -577,6 +577,10 @@ let error_log handle poolname =
       in
       Error (e, what, why)
 
+(* The error log collapsed and resolved to names, see Errlog.resolve. *)
+let errors jobs cache handle poolname =
+  Errlog.resolve jobs cache handle poolname
+
 let clear handle poolname =
   match
     Ioctls.clear handle poolname None None
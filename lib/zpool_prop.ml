@@ -93,7 +93,7 @@ type attributes = {
   index_table : (string * int64) array;
 }
 
-let attributes =
+let make_attributes =
   let empty_index_table = [||] in
   let boolean_values = Some "on | off" in
   let boolean_index_table = [| ("off", 0L); ("on", 1L) |] in
@@ -640,50 +640,138 @@ let attributes =
         index_table = empty_index_table;
       }
 
+external int_of_t : t -> int = "caml_zfs_util_int_of_t"
+
+(* Every constructor in declaration order, so all_props.(int_of_t p) = p. *)
+let all_props =
+  [|
+    Allocated;
+    Altroot;
+    Ashift;
+    Autoexpand;
+    Autoreplace;
+    Autotrim;
+    Bcloneratio;
+    Bclonesaved;
+    Bcloneused;
+    Bootfs;
+    Cachefile;
+    Capacity;
+    Checkpoint;
+    Comment;
+    Compatibility;
+    Dedupditto;
+    Dedupratio;
+    Delegation;
+    Expandsz;
+    Failuremode;
+    Fragmentation;
+    Free;
+    Freeing;
+    Guid;
+    Health;
+    Inval;
+    Leaked;
+    Listsnaps;
+    Load_guid;
+    Maxblocksize;
+    Maxdnodesize;
+    Multihost;
+    Name;
+    Readonly;
+    Size;
+    Tname;
+    Version;
+  |]
+
+(* Inval has no attributes. *)
+let table =
+  Prop_table.create all_props
+    (function Inval -> None | prop -> Some (make_attributes prop))
+    (fun attributes -> attributes.index_table)
+
+let entry prop = Prop_table.find table (int_of_t prop)
+let attributes prop = (entry prop).attributes
 let to_string prop = (attributes prop).name
+let string_to_index prop str = Prop_table.string_to_index (entry prop) str
+let index_to_string prop idx = Prop_table.index_to_string (entry prop) idx
 
-let string_to_index prop str =
-  (attributes prop).index_table
-  |> Array.find_map (fun (s, i) -> if s = str then Some i else None)
+(*
+ * Parsed compatibility.d files by path, with the mtime and size they were
+ * read at.  A file is only read and parsed again once either changes.
+ *)
+type compat_cache = {
+  files : (string, float * int * Zfeature.set option) Hashtbl.t;
+  lock : Mutex.t;
+}
 
-let index_to_string prop idx =
-  (attributes prop).index_table
-  |> Array.find_map (fun (s, i) -> if i = idx then Some s else None)
+let compat_cache = { files = Hashtbl.create 8; lock = Mutex.create () }
 
-let load_compat compat =
-  let module StringSet = Set.Make (String) in
-  if compat = "" || compat = "off" then Ok (Array.to_list Zfeature.all_features)
-  else if compat = "legacy" then Ok []
-  else
-    let read_compat_file path =
-      try
-        let fd = Unix.openfile path [ Unix.O_RDONLY; Unix.O_CLOEXEC ] 0 in
+let compat_dirs =
+  [ "/etc/zfs/compatibility.d/"; "/usr/share/zfs/compatibility.d/" ]
+
+let parse_compat_file contents =
+  String.split_on_char '\n' contents
+  |> List.map (String.split_on_char '#')
+  |> List.map List.hd
+  |> List.concat_map (Str.split (Str.regexp "[, \t][ \t]*"))
+  |> List.map String.trim
+  |> List.fold_left
+       (fun set feature ->
+         match String.split_on_char ':' feature with
+         | [ _org; featname ] ->
+             let feat = Zfeature.of_string featname in
+             if feat <> None && (Zfeature.attributes feat).guid = feature then
+               Zfeature.set_add feat set
+             else set
+         | _ -> set)
+       Zfeature.empty_set
+
+(* The features of a file, None if it is missing or of an unexpected size. *)
+let read_compat_file path =
+  let fresh (st : Unix.stats) (mtime, size, _) =
+    Float.equal mtime st.st_mtime && size = st.st_size
+  in
+  let cached st =
+    Mutex.lock compat_cache.lock;
+    let entry = Hashtbl.find_opt compat_cache.files path in
+    Mutex.unlock compat_cache.lock;
+    match entry with
+    | Some ((_, _, set) as entry) when fresh st entry -> Some set
+    | _ -> None
+  in
+  let read () =
+    let fd = Unix.openfile path [ Unix.O_RDONLY; Unix.O_CLOEXEC ] 0 in
+    let ic = Unix.in_channel_of_descr fd in
+    Fun.protect
+      ~finally:(fun () -> close_in_noerr ic)
+      (fun () ->
         let st = Unix.fstat fd in
-        if st.st_size < 1 || st.st_size > 16384 then None
-        else
-          let ic = Unix.in_channel_of_descr fd in
-          really_input_string ic st.st_size
-          |> String.split_on_char '\n'
-          |> List.map (String.split_on_char '#')
-          |> List.map List.hd
-          |> List.concat_map (Str.split (Str.regexp "[, \t][ \t]*"))
-          |> List.map String.trim
-          |> List.filter_map (fun feature ->
-                 match String.split_on_char ':' feature with
-                 | [ _org; featname ] ->
-                     let feat = Zfeature.of_string featname in
-                     if feat = None then None
-                     else
-                       let attrs = Zfeature.attributes feat in
-                       if attrs.guid = feature then Some attrs.name else None
-                 | _ -> None)
-          |> StringSet.of_list |> Option.some
-      with Unix.Unix_error (Unix.ENOENT, _, _) -> None
-    in
+        let set =
+          if st.st_size < 1 || st.st_size > 16384 then None
+          else Some (parse_compat_file (really_input_string ic st.st_size))
+        in
+        Mutex.lock compat_cache.lock;
+        Hashtbl.replace compat_cache.files path (st.st_mtime, st.st_size, set);
+        Mutex.unlock compat_cache.lock;
+        set)
+  in
+  try
+    match cached (Unix.stat path) with Some set -> set | None -> read ()
+  with Unix.Unix_error (Unix.ENOENT, _, _) -> None
+
+(*
+ * The features allowed by a compatibility property value, as a set: those
+ * listed by every file it names.
+ *)
+let load_compat_set compat =
+  if compat = "" || compat = "off" then Ok Zfeature.full_set
+  else if compat = "legacy" then Ok Zfeature.empty_set
+  else
     let results =
       String.split_on_char ',' compat
       |> List.map (fun filename ->
-             [ "/etc/zfs/compatibility.d/"; "/usr/share/zfs/compatibility.d/" ]
+             compat_dirs
              |> List.find_map (fun directory ->
                     read_compat_file (directory ^ filename))
              |> Option.to_result ~none:filename)
@@ -692,14 +780,13 @@ let load_compat compat =
     if not (List.is_empty errors) then
       Error (List.map Result.get_error errors |> String.concat ", ")
     else
-      let sets = List.map Result.get_ok results in
-      let full =
-        Zfeature.all_features
-        |> Array.map (fun feature -> (Zfeature.attributes feature).name)
-        |> Array.to_list |> StringSet.of_list
-      in
-      let intersection = List.fold_left StringSet.inter full sets in
-      Ok (StringSet.to_list intersection |> List.map Zfeature.of_string)
+      Ok
+        (List.fold_left
+           (fun set result -> Zfeature.set_inter set (Result.get_ok result))
+           Zfeature.full_set results)
+
+let load_compat compat =
+  Result.map Zfeature.set_to_list (load_compat_set compat)
 
 type checked_value = String of string | Uint64 of int64
 
@@ -904,7 +991,7 @@ let validate nvl poolname version create import =
                               dirpath )
                       else Ok ()
               | Compatibility -> (
-                  match load_compat strval with
+                  match load_compat_set strval with
                   | Ok _features -> Ok ()
                   | Error files -> Error (EzfsBadProp, files))
               | Comment ->
@@ -981,23 +1068,37 @@ let validate nvl poolname version create import =
   in
   iter_pairs None
 
+let reserved_pool_names = [| "mirror"; "raidz"; "draid"; "spare"; "log" |]
+
+let max_pool_name_len =
+  Const.max_name_len - 2 - (2 * String.length Const.origin_dir_name)
+
+(* Characters of pool names by code: 0 invalid, 1 valid, 2 letters. *)
+let pool_name_classes =
+  String.init 256 (fun code ->
+      match Char.chr code with
+      | 'a' .. 'z' | 'A' .. 'Z' -> '\002'
+      | '0' .. '9' | '-' | '_' | '.' | ':' | ' ' -> '\001'
+      | _ -> '\000')
+
+let pool_name_class c =
+  Char.code (String.unsafe_get pool_name_classes (Char.code c))
+
 let validate_name name opening =
-  let reserved = [| "mirror"; "raidz"; "draid"; "spare"; "log" |] in
   let name_starts_with prefix = String.starts_with ~prefix name in
-  let max_pool_name_len =
-    Const.max_name_len - 2 - (2 * String.length Const.origin_dir_name)
-  in
-  let valid_chars = Str.regexp "^[a-zA-Z0-9-_.: ]+$" in
-  let valid_first_char = Str.regexp "^[a-zA-Z]" in
-  if (not opening) && Array.exists name_starts_with reserved then
+  if (not opening) && Array.exists name_starts_with reserved_pool_names then
     Error "name is reserved"
   else if String.length name >= max_pool_name_len then Error "name is too long"
-  else if not (Str.string_match valid_chars name 0) then
-    Error "invalid character in pool name"
-  else if not (Str.string_match valid_first_char name 0) then
+  else if
+    name = "" || not (String.for_all (fun c -> pool_name_class c > 0) name)
+  then Error "invalid character in pool name"
+  else if pool_name_class name.[0] <> 2 then
     Error "name must begin with a letter"
   else Ok ()
 
+let validate_names names opening =
+  Array.map (fun name -> validate_name name opening) names
+
 let has_special_vdev nvl =
   let open Nvpair in
   match Nvlist.lookup_nvlist_array nvl "children" with
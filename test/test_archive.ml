@@ -0,0 +1,79 @@
+open Lib
+
+(* A synthetic stream: BEGIN, a WRITE of 512 bytes per object, END. *)
+let stream objects =
+  let buf = Buffer.create 4096 in
+  let header rtype f =
+    let h = Bytes.make Send_stream.drr_size '\000' in
+    Bytes.set_int32_le h 0 (Int32.of_int rtype);
+    f h;
+    Buffer.add_bytes buf h
+  in
+  header 0 (fun h ->
+      Bytes.set_int64_le h 8 Send_stream.backup_magic;
+      Bytes.set_int64_le h 40 0x1234L;
+      Bytes.set_int64_le h 48 0x5678L);
+  for obj = 1 to objects do
+    header 3 (fun h ->
+        Bytes.set_int64_le h 8 (Int64.of_int obj);
+        Bytes.set_int64_le h 32 512L);
+    Buffer.add_string buf (String.make 512 (Char.chr (obj land 0xff)))
+  done;
+  header 5 ignore;
+  Buffer.to_bytes buf
+
+let write_to path data =
+  let flags = [ Unix.O_WRONLY; Unix.O_CREAT; Unix.O_TRUNC ] in
+  let fd = Unix.openfile path flags 0o644 in
+  Send_stream.really_write fd data 0 (Bytes.length data);
+  Unix.close fd
+
+let read_from path =
+  let fd = Unix.openfile path [ Unix.O_RDONLY ] 0 in
+  let len = (Unix.fstat fd).Unix.st_size in
+  let buf = Bytes.create len in
+  ignore (Send_stream.really_read fd buf 0 len);
+  Unix.close fd;
+  buf
+
+let () =
+  let dir = Filename.temp_dir "test_archive" "" in
+  let data = stream 20 in
+  let input = Filename.concat dir "input" in
+  write_to input data;
+  let archive = Filename.concat dir "archive" in
+  Unix.mkdir archive 0o755;
+  let fd = Unix.openfile input [ Unix.O_RDONLY ] 0 in
+  let index =
+    match Archive.write archive 2048 fd with
+    | Ok index -> index
+    | Error (_, what, why) -> failwith (what ^ ": " ^ why)
+  in
+  Unix.close fd;
+  assert (index.Archive.toguid = 0x1234L);
+  assert (index.fromguid = 0x5678L);
+  assert (Array.length index.chunks > 1);
+  assert (Archive.read_index archive = Ok index);
+  assert (Archive.verify 2 archive index = []);
+  assert (Archive.chunks_for_object index 1L = [ 0 ]);
+  (* Concatenating the chunks gives back the original stream. *)
+  let output = Filename.concat dir "output" in
+  let fd = Unix.openfile output [ Unix.O_WRONLY; Unix.O_CREAT ] 0o644 in
+  assert (Archive.cat archive index fd = Ok ());
+  Unix.close fd;
+  assert (Bytes.equal (read_from output) data);
+  (* Damaged chunks are reported by verify and refused by cat: a chunk with
+     a flipped byte fails the digest, a truncated one the length. *)
+  let flipped = Filename.concat archive (Archive.chunk_name 0) in
+  let chunk = read_from flipped in
+  Bytes.set_uint8 chunk 0 (Bytes.get_uint8 chunk 0 lxor 0xff);
+  write_to flipped chunk;
+  assert (Archive.verify 2 archive index = [ 0 ]);
+  let truncated = Filename.concat archive (Archive.chunk_name 1) in
+  write_to truncated (Bytes.of_string "x");
+  assert (Archive.verify 2 archive index = [ 0; 1 ]);
+  let fd = Unix.openfile output [ Unix.O_WRONLY; Unix.O_TRUNC ] 0 in
+  (match Archive.cat archive index fd with
+  | Error (Error.EzfsBadStream, _, _) -> ()
+  | _ -> assert false);
+  Unix.close fd
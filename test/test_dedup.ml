@@ -0,0 +1,65 @@
+open Lib
+
+(*
+ * A synthetic stream: BEGIN, a WRITE of 512 bytes per object where only
+ * every fourth payload is new, then END.
+ *)
+let stream objects =
+  let buf = Buffer.create 4096 in
+  let header rtype f =
+    let h = Bytes.make Send_stream.drr_size '\000' in
+    Bytes.set_int32_le h 0 (Int32.of_int rtype);
+    f h;
+    Buffer.add_bytes buf h
+  in
+  header 0 (fun h -> Bytes.set_int64_le h 8 Send_stream.backup_magic);
+  for obj = 1 to objects do
+    header 3 (fun h ->
+        Bytes.set_int64_le h 8 (Int64.of_int obj);
+        Bytes.set_int64_le h 32 512L);
+    Buffer.add_string buf (String.make 512 (Char.chr (obj / 4)))
+  done;
+  header 5 ignore;
+  Buffer.to_bytes buf
+
+let with_file path flags f =
+  let fd = Unix.openfile path flags 0o644 in
+  Fun.protect ~finally:(fun () -> Unix.close fd) (fun () -> f fd)
+
+let read_from path =
+  with_file path [ Unix.O_RDONLY ] @@ fun fd ->
+  let len = (Unix.fstat fd).Unix.st_size in
+  let buf = Bytes.create len in
+  ignore (Send_stream.really_read fd buf 0 len);
+  buf
+
+let get = function
+  | Ok x -> x
+  | Error (_, what, why) -> failwith (what ^ ": " ^ why)
+
+let () =
+  let dir = Filename.temp_dir "test_dedup" "" in
+  let path name = Filename.concat dir name in
+  let data = stream 16 in
+  with_file (path "input") [ Unix.O_WRONLY; Unix.O_CREAT ] (fun fd ->
+      Send_stream.really_write fd data 0 (Bytes.length data));
+  let store = get @@ Dedup.open_store (path "store") in
+  let stats =
+    with_file (path "input") [ Unix.O_RDONLY ] @@ fun src ->
+    with_file (path "container") [ Unix.O_WRONLY; Unix.O_CREAT ] @@ fun dst ->
+    get @@ Dedup.dedup store src dst
+  in
+  Dedup.close_store store;
+  assert (stats.Dedup.stream_bytes = Bytes.length data);
+  assert (stats.write_bytes = 16 * 512);
+  assert (stats.new_block_bytes = 5 * 512);
+  (* The index was written, so a reopened store can rehydrate. *)
+  let store = get @@ Dedup.open_store (path "store") in
+  let stats =
+    with_file (path "container") [ Unix.O_RDONLY ] @@ fun src ->
+    with_file (path "output") [ Unix.O_WRONLY; Unix.O_CREAT ] @@ fun dst ->
+    get @@ Dedup.rehydrate store src dst
+  in
+  Dedup.close_store store;
+  assert (stats.Dedup.stream_bytes = Bytes.length data);
+  assert (Bytes.equal (read_from (path "output")) data)
@@ -0,0 +1,46 @@
+open Lib
+open Diff
+
+let file = 0o100644L
+let dir = 0o040755L
+
+let stat ?(gen = 1L) ?(mode = file) ?(links = 1L) ?(ctime = (1L, 0L)) () =
+  { Types.gen; mode; links; ctime }
+
+let () =
+  let s = stat () in
+  let touched = stat ~ctime:(2L, 0L) () in
+  assert (inuse_events None None = []);
+  assert (inuse_events None (Some ("/a", s)) = [ Added ("/a", s) ]);
+  assert (inuse_events (Some ("/a", s)) None = [ Removed ("/a", s) ]);
+  (* An unchanged ctime means the object did not change. *)
+  assert (inuse_events (Some ("/a", s)) (Some ("/b", s)) = []);
+  assert (
+    inuse_events (Some ("/a", s)) (Some ("/a", touched))
+    = [ Modified ("/a", touched) ]);
+  assert (
+    inuse_events (Some ("/a", s)) (Some ("/b", touched))
+    = [ Renamed ("/a", "/b", touched) ]);
+  (* A new generation or file type is a different object. *)
+  let reused = stat ~gen:2L () in
+  assert (
+    inuse_events (Some ("/a", s)) (Some ("/b", reused))
+    = [ Removed ("/a", s); Added ("/b", reused) ]);
+  let retyped = stat ~mode:dir ~ctime:(2L, 0L) () in
+  assert (
+    inuse_events (Some ("/a", s)) (Some ("/a", retyped))
+    = [ Removed ("/a", s); Added ("/a", retyped) ]);
+  (* A link count change names the old path when a link was added. *)
+  let linked = stat ~links:2L ~ctime:(2L, 0L) () in
+  assert (
+    inuse_events (Some ("/a", s)) (Some ("/b", linked))
+    = [ Modified ("/a", linked) ]);
+  assert (
+    inuse_events (Some ("/b", linked)) (Some ("/a", touched))
+    = [ Modified ("/a", touched) ]);
+  (* Link counts of directories do not count as link changes. *)
+  let d = stat ~mode:dir ~links:2L () in
+  let d' = stat ~mode:dir ~links:3L ~ctime:(1L, 5L) () in
+  assert (
+    inuse_events (Some ("/d", d)) (Some ("/e", d'))
+    = [ Renamed ("/d", "/e", d') ])
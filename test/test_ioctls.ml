@@ -259,7 +259,7 @@ let common_hold_create snap tag =
   let packed_args = Nvlist.pack args Nvlist.Native in
   let handle = Ioctls.open_handle () in
   match Ioctls.hold handle test_pool_name packed_args with
-  | Ok () -> ()
+  | Ok _ -> ()
   | Error (Some packed_errors, e) ->
       let _errors = Nvlist.unpack packed_errors in
       Printf.eprintf "hold failed (with errors)\n";
@@ -0,0 +1,42 @@
+open Lib
+
+let fs = [| Zfs_prop.Filesystem |]
+let snap = [| Zfs_prop.Snapshot |]
+
+let () =
+  assert (Ok () = Zfs_prop.validate_name "tank/home/alice" fs true);
+  assert (Ok () = Zfs_prop.validate_name "tank/vm@auto-2024:01" snap true);
+  assert (
+    Error "snapshot delimiter '@' is not expected here"
+    = Zfs_prop.validate_name "tank@snap" fs true);
+  assert (
+    Error "empty component or misplaced '@' or '#' delimiter in name"
+    = Zfs_prop.validate_name "tank//home" fs true);
+  assert (
+    Error "parent reference, '..' is found in name"
+    = Zfs_prop.validate_name "tank/../home" fs true);
+  assert (
+    Error "invalid character '!' in name"
+    = Zfs_prop.validate_name "tank/a!b/c$" fs true);
+  assert (
+    Error "invalid character '%' in name"
+    = Zfs_prop.validate_name "tank/%recv" fs true);
+  assert (
+    Error "multiple '@' and/or '#' delimiters in name"
+    = Zfs_prop.validate_name "tank@a@b" snap true);
+  assert (
+    Zfs_prop.validate_names [| "tank/a"; "/tank" |] fs false
+    = [| Ok (); Error "leading slash in name" |])
+
+let () =
+  assert (Ok () = Zpool_prop.validate_name "tank-0.ssd" false);
+  assert (Error "name is reserved" = Zpool_prop.validate_name "mirror1" false);
+  assert (
+    Error "name must begin with a letter"
+    = Zpool_prop.validate_name "0tank" false);
+  assert (
+    Error "invalid character in pool name"
+    = Zpool_prop.validate_name "tank@x" false);
+  assert (
+    Error "invalid character in pool name"
+    = Zpool_prop.validate_name "tank\nx" false)
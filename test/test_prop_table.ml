@@ -0,0 +1,38 @@
+open Lib
+
+(*
+ * all_props lists every constructor in declaration order, so the tables
+ * indexed by int_of_t cover each property exactly once, and names survive
+ * the round trip through the index tables.
+ *)
+
+let () =
+  let open Zfs_prop in
+  Array.iteri (fun i p -> assert (int_of_t p = i)) all_props;
+  Array.iter (fun p -> assert (all_props.(int_of_t p) = p)) all_props;
+  assert (int_of_t Zoned = Array.length all_props - 1);
+  Array.iter
+    (function
+      | Inval | Userprop -> ()
+      | p -> assert (of_string (to_string p) = p))
+    all_props
+
+let () =
+  let open Zpool_prop in
+  Array.iteri (fun i p -> assert (int_of_t p = i)) all_props;
+  Array.iter (fun p -> assert (all_props.(int_of_t p) = p)) all_props;
+  assert (int_of_t Version = Array.length all_props - 1);
+  Array.iter
+    (function Inval -> () | p -> assert (of_string (to_string p) = p))
+    all_props
+
+let () =
+  let open Vdev_prop in
+  Array.iteri (fun i p -> assert (int_of_t p = i)) all_props;
+  Array.iter (fun p -> assert (all_props.(int_of_t p) = p)) all_props;
+  assert (int_of_t Write_errors = Array.length all_props - 1);
+  Array.iter
+    (function
+      | Inval | Userprop -> ()
+      | p -> assert (of_string (to_string p) = p))
+    all_props
@@ -0,0 +1,157 @@
+open Nvpair
+open Lib
+
+let () =
+  if Unix.getuid () != 0 then (
+    Printf.eprintf "must be root to run these tests\n";
+    exit 1)
+
+(* Distinct from test_ioctls so both can run at the same time. *)
+let test_pool_name = "reppool"
+let test_source_name = Printf.sprintf "%s/src" test_pool_name
+let test_target_name = Printf.sprintf "%s/dst" test_pool_name
+let test_children = [ "a"; "b"; "a/c" ]
+let test_vdev_name = "repdev"
+let test_vdev_size = Int.shift_left 128 20 (* 128 MiB *)
+let test_jobs = 2
+
+let vdev_file_create name =
+  let home = Sys.getenv "HOME" in
+  let path = Printf.sprintf "%s/%s" home name in
+  let fd =
+    Unix.openfile path [ Unix.O_WRONLY; Unix.O_CREAT; Unix.O_TRUNC ] 0o660
+  in
+  ignore @@ Unix.lseek fd (test_vdev_size - 1) Unix.SEEK_SET;
+  ignore @@ Unix.write fd (Bytes.make 1 (Char.chr 0)) 0 1;
+  Unix.close fd;
+  path
+
+let common_pack_root_vdevs vdevs =
+  let root = Nvlist.alloc () in
+  Nvlist.add_string root "type" "root";
+  let disks =
+    Array.of_list
+    @@ List.map
+         (fun path ->
+           let disk = Nvlist.alloc () in
+           Nvlist.add_string disk "path" path;
+           Nvlist.add_string disk "type" "file";
+           Nvlist.add_uint64 disk "is_log" 0L;
+           disk)
+         vdevs
+  in
+  Nvlist.add_nvlist_array root "children" disks;
+  Nvlist.pack root Nvlist.Native
+
+let common_setup () =
+  let vdevs = [ vdev_file_create test_vdev_name ] in
+  let handle = Ioctls.open_handle () in
+  let config = common_pack_root_vdevs vdevs in
+  (match Ioctls.pool_create handle test_pool_name config None with
+  | Ok () -> ()
+  | Error e ->
+      Printf.eprintf "pool_create failed\n";
+      failwith @@ Unix.error_message e);
+  vdevs
+
+let common_cleanup vdevs =
+  let handle = Ioctls.open_handle () in
+  (match Ioctls.pool_destroy handle test_pool_name "deleting test pool" with
+  | Ok () -> ()
+  | Error e ->
+      Printf.eprintf "pool_destroy failed\n";
+      failwith @@ Unix.error_message e);
+  List.iter Unix.unlink vdevs
+
+let common_dataset_create name =
+  let args = Nvlist.alloc () in
+  Nvlist.add_int32 args "type" 2l (* ObjsetTypeZfs *);
+  let packed_args = Nvlist.pack args Nvlist.Native in
+  let handle = Ioctls.open_handle () in
+  match Ioctls.create handle name packed_args with
+  | Ok () -> ()
+  | Error e ->
+      Printf.eprintf "create failed\n";
+      failwith @@ Unix.error_message e
+
+(* Snapshot the whole source tree atomically. *)
+let common_snapshots_create snapname =
+  let args = Nvlist.alloc () in
+  let snaps = Nvlist.alloc () in
+  List.iter
+    (fun name -> Nvlist.add_boolean snaps (name ^ "@" ^ snapname))
+    (test_source_name
+    :: List.map (fun child -> test_source_name ^ "/" ^ child) test_children);
+  Nvlist.add_nvlist args "snaps" snaps;
+  let packed_args = Nvlist.pack args Nvlist.Native in
+  let handle = Ioctls.open_handle () in
+  match Ioctls.snapshot handle test_pool_name packed_args with
+  | Ok () -> ()
+  | Error (_, e) ->
+      Printf.eprintf "snapshot failed\n";
+      failwith @@ Unix.error_message e
+
+let common_replicate () =
+  let flags = [||] in
+  let cache = Send_estimate.create_cache () in
+  match
+    Replicate.plan test_jobs cache flags test_source_name test_target_name
+  with
+  | Ok plans ->
+      let report = Replicate.run test_jobs None None None flags false plans in
+      List.iter
+        (fun (result : Replicate.transfer_result) ->
+          match result.error with
+          | Some (_, what, why) ->
+              Printf.eprintf "%s: %s\n" what why;
+              failwith "replication failed"
+          | None -> ())
+        report.Replicate.results;
+      report
+  | Error (_, what, why) ->
+      Printf.eprintf "%s: %s\n" what why;
+      failwith "replication planning failed"
+
+let common_check_replica snapname =
+  let handle = Ioctls.open_handle () in
+  List.iter
+    (fun name ->
+      let source = Printf.sprintf "%s%s@%s" test_source_name name snapname in
+      let target = Printf.sprintf "%s%s@%s" test_target_name name snapname in
+      match
+        (Zfs.stats_simple handle source, Zfs.stats_simple handle target)
+      with
+      | Ok source_stats, Ok target_stats ->
+          if
+            not
+              (Int64.equal source_stats.Types.guid target_stats.Types.guid)
+          then failwith @@ Printf.sprintf "%s has the wrong guid" target
+      | Error (_, what, why), _ | _, Error (_, what, why) ->
+          Printf.eprintf "%s: %s\n" what why;
+          failwith "stats failed")
+    ("" :: List.map (fun child -> "/" ^ child) test_children)
+
+(* full tree, then incremental tree *)
+let () =
+  let vdevs = common_setup () in
+  common_dataset_create test_source_name;
+  List.iter
+    (fun child -> common_dataset_create (test_source_name ^ "/" ^ child))
+    test_children;
+  common_snapshots_create "first";
+  let report = common_replicate () in
+  let nresults = List.length report.Replicate.results in
+  if nresults != 1 + List.length test_children then
+    failwith "expected one full send per dataset";
+  common_check_replica "first";
+  common_snapshots_create "second";
+  common_snapshots_create "third";
+  let report = common_replicate () in
+  if
+    List.exists
+      (fun (result : Replicate.transfer_result) ->
+        Option.is_none result.transfer.fromsnap)
+      report.Replicate.results
+  then failwith "expected only incremental sends";
+  common_check_replica "third";
+  common_cleanup vdevs
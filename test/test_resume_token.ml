@@ -0,0 +1,55 @@
+open Lib
+
+(*
+ * A token for a send of tank/fs@snap2 from fromguid 0x1122334455667788,
+ * interrupted at offset 0x20000 of object 42, with embedok set.
+ *)
+let token =
+  "1-f7b508439-114-\
+   789c6364648001104b058835809823ad283f37bd343305c406c9092a19bb84a6\
+   957740d52800315b7e52566a7209582f07543f0868a1a8494b2b4e4557c30426\
+   616a58932a4b528b19d0d4303e724036a7241fea1aa81aeeb507febf83a83580\
+   ba19a8262f313715ac86136a0e6f49625eb67e5ab143715e628111c40e192096\
+   0062f6d4dca4d494fc6c060684dbc1000082fb20b9"
+
+let () =
+  match Resume_token.decode token with
+  | Ok resume ->
+      assert (resume.Resume_token.fromguid = Some 0x1122334455667788L);
+      assert (resume.toguid = 0x0badc0ffee000001L);
+      assert (resume.toname = "tank/fs@snap2");
+      assert (resume.obj = 42L);
+      assert (resume.offset = 0x20000L);
+      assert (resume.bytes = 123456L);
+      assert (resume.flags = [| Types.LzcSendFlagEmbedData |])
+  | Error why -> failwith why
+
+(* Flipping a payload digit breaks the checksum. *)
+let () =
+  let corrupt = Bytes.of_string token in
+  let i = Bytes.length corrupt - 40 in
+  Bytes.set corrupt i (if Bytes.get corrupt i = '0' then '1' else '0');
+  assert (
+    Resume_token.decode (Bytes.to_string corrupt)
+    = Error "resume token is corrupt (incorrect checksum)")
+
+let () =
+  assert (
+    Resume_token.decode ("2" ^ String.sub token 1 (String.length token - 1))
+    = Error "resume token is corrupt (invalid version 2)");
+  assert (
+    Resume_token.decode "1-0-0"
+    = Error "resume token is corrupt (invalid format)")
+
+let () =
+  assert (
+    Resume_token.bytes_of_hex "00a0ff" = Some (Bytes.of_string "\000\160\255"));
+  assert (Resume_token.bytes_of_hex "abc" = None);
+  assert (Resume_token.bytes_of_hex "zz" = None)
+
+(* Word 0 is the sum of the native order 32 bit words, unsigned. *)
+let () =
+  let buf = Bytes.make 9 '\007' in
+  Bytes.set_int32_ne buf 0 1l;
+  Bytes.set_int32_ne buf 4 (-1l);
+  assert (Resume_token.fletcher4_word0 buf = 0x100000000L)
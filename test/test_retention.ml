@@ -0,0 +1,85 @@
+open Lib
+
+(*
+ * A model of the space oracle: each block is referenced by snapshots
+ * first..last and has a size, a last of n meaning the live filesystem
+ * still references it.
+ *)
+let oracle blocks =
+  let sum f =
+    List.fold_left
+      (fun acc (first, last, size) ->
+        if f first last then Int64.add acc size else acc)
+      0L blocks
+  in
+  let freed i j = Ok (sum (fun first last -> i <= first && last <= j), true) in
+  let upper i j = sum (fun first _ -> i <= first && first <= j) in
+  (upper, freed)
+
+let search n deletable blocks target =
+  let upper, freed = oracle blocks in
+  match Retention.search n deletable upper freed target with
+  | Ok (runs, used, exact) ->
+      assert exact;
+      let cost = List.fold_left (fun acc (i, j) -> acc + j - i + 1) 0 runs in
+      (runs, used, cost)
+  | Error _ -> assert false
+
+(* The cheapest cost of freeing target, by trying every set. *)
+let brute n deletable blocks target =
+  let best = ref None in
+  for set = 0 to (1 lsl n) - 1 do
+    let member i = set land (1 lsl i) <> 0 in
+    let indices = List.init n Fun.id in
+    if List.for_all (fun i -> deletable i || not (member i)) indices then
+      let covered first last =
+        last < n
+        && List.for_all member (List.init (last - first + 1) (( + ) first))
+      in
+      let freed =
+        List.fold_left
+          (fun acc (first, last, size) ->
+            if covered first last then Int64.add acc size else acc)
+          0L blocks
+      in
+      let cost = List.length (List.filter member indices) in
+      if Int64.compare freed target >= 0 then
+        match !best with
+        | Some c when c <= cost -> ()
+        | _ -> best := Some cost
+  done;
+  !best
+
+let () =
+  (* Two runs apart beat one run across the snapshot between them. *)
+  let blocks = [ (0, 0, 10L); (2, 2, 1L); (4, 4, 10L); (0, 5, 100L) ] in
+  let all _ = true in
+  assert (search 5 all blocks 20L = ([ (0, 0); (4, 4) ], 20L, 2));
+  (* A block shared by adjacent snapshots needs both. *)
+  let blocks = [ (1, 2, 30L); (0, 0, 10L); (3, 3, 10L) ] in
+  assert (search 4 all blocks 30L = ([ (1, 2) ], 30L, 2));
+  (* Protected snapshots are never destroyed, even if the target is missed. *)
+  let deletable i = i <> 1 in
+  assert (search 4 deletable blocks 100L = ([ (0, 0); (2, 3) ], 20L, 3));
+  (* The cost matches an exhaustive search on random histories. *)
+  Random.init 42;
+  for _ = 1 to 200 do
+    let n = 1 + Random.int 7 in
+    let blocks =
+      List.init (Random.int 8) (fun _ ->
+          let first = Random.int n in
+          let last = first + Random.int (n - first + 1) in
+          (first, last, Int64.of_int (1 + Random.int 20)))
+    in
+    let protected = Random.int (n + 1) in
+    let deletable i = i <> protected in
+    let target = Int64.of_int (Random.int 40) in
+    let _, used, cost = search n deletable blocks target in
+    match brute n deletable blocks target with
+    | Some best ->
+        assert (Int64.compare used target >= 0);
+        assert (cost = best)
+    | None ->
+        let deletable = List.filter deletable (List.init n Fun.id) in
+        assert (cost = List.length deletable)
+  done
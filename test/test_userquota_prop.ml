@@ -4,3 +4,18 @@ let () =
   assert (
     Some (Userquota_prop.Userquota, 0)
     = Userquota_prop.decode_propname "userquota@root" false)
+
+let () =
+  let decoded =
+    Userquota_prop.decode_propnames
+      [| "userquota@root"; "groupused@0"; "userquota@root"; "bogus@root" |]
+      false
+  in
+  assert (
+    decoded
+    = [|
+        Some (Userquota_prop.Userquota, 0);
+        Some (Userquota_prop.Groupused, 0);
+        Some (Userquota_prop.Userquota, 0);
+        None;
+      |])
@@ -0,0 +1,16 @@
+open Nvpair
+open Lib
+
+let validate propname value keyok =
+  let nvl = Nvlist.alloc () in
+  Nvlist.add_string nvl propname value;
+  Zfs_prop.validate nvl Zfs_prop.Filesystem false false keyok
+
+(* Native properties can be set without keyok. *)
+let () = assert (Result.is_ok (validate "compression" "lz4" false))
+
+(* Encryption key parameters need keyok. *)
+let () =
+  match validate "keyformat" "passphrase" false with
+  | Error (Error.EzfsPropReadonly, _) -> ()
+  | _ -> assert false